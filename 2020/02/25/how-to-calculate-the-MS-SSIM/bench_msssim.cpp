@@ -0,0 +1,244 @@
+/*
+ * bench_msssim.cpp
+ * Google Benchmark microbenchmarks for the MS-SSIM kernels in msssim_core.h,
+ * each timed on its own over a resolution sweep (360p to 8K) of synthetic
+ * content, and reported in (luma) pixels per second:
+ *
+ *   ssim_4x4x2_core     block sums of a whole plane
+ *   ssim_end4           the end stage of a whole plane, on precomputed sums
+ *   ssim_end_fast       the same with --fast-end (8-bit on AVX2 only)
+ *   downsample_2x2_mean one 2x2 downsample of a whole plane
+ *   ssim_plane          single-scale SSIM of a plane (sums + end stage)
+ *   ms_ssim_plane       the whole 5-scale MS-SSIM of a plane
+ *
+ * The kernels run through the same runtime dispatch as the CLI; build with
+ * -DMSSSIM_NO_SIMD to benchmark the C versions.
+ *
+ * g++ -O2 -pthread -o bench_msssim bench_msssim.cpp -lbenchmark
+ * ./bench_msssim --benchmark_filter=ssim_plane
+ */
+#include <benchmark/benchmark.h>
+
+#include "msssim_core.h"
+
+static const int RESOLUTIONS[][2] = {
+    {640, 360}, {1280, 720}, {1920, 1080}, {3840, 2160}, {7680, 4320},
+};
+
+/*
+ * 合成的内容：正弦的纹理加噪声，失真是在参考上再加一点噪声，与真实的编码失真一样
+ * 两幅图很接近，ssim_end1里的除法不会走到特殊的值上。固定种子，每次运行都一样。
+ */
+template <int depth>
+struct SyntheticPlane
+{
+    typedef typename PixelTraits<depth>::pixel pixel;
+
+    int width;
+    int height;
+    std::vector<pixel> ref;
+    std::vector<pixel> dist;
+
+    SyntheticPlane(int w, int h) : width(w), height(h), ref((size_t)w * h + PIXEL_PADDING), dist((size_t)w * h + PIXEL_PADDING)
+    {
+        const int pixel_max = PixelTraits<depth>::pixel_max;
+        uint32_t seed = 1;
+        for (int y = 0; y < h; y++)
+        {
+            for (int x = 0; x < w; x++)
+            {
+                seed = seed * 1664525 + 1013904223;
+                double v = pixel_max * (0.5 + 0.23 * sin(x * 0.05) * cos(y * 0.07)) + (int)(seed >> 24) % 40 - 20;
+                int a = FFMIN(FFMAX((int)v, 0), pixel_max);
+                int b = FFMIN(FFMAX(a + (int)(seed >> 16 & 0xff) % 21 - 10, 0), pixel_max);
+                ref[(size_t)y * w + x]  = a;
+                dist[(size_t)y * w + x] = b;
+            }
+        }
+    }
+};
+
+static void set_pixels(benchmark::State &state, int width, int height)
+{
+    state.SetItemsProcessed(state.iterations() * (int64_t)width * height);
+    state.SetLabel(std::to_string(width) + "x" + std::to_string(height) + " pixels");
+}
+
+template <int depth>
+static void BM_ssim_4x4x2_core(benchmark::State &state)
+{
+    typedef typename PixelTraits<depth>::pixel pixel;
+    typedef typename PixelTraits<depth>::sum_t sum_t;
+    const SSIMDSPContext<depth> &dsp = ssim_dsp<depth>();
+    SyntheticPlane<depth> plane(state.range(0), state.range(1));
+    int width  = plane.width >> 2;
+    int height = plane.height >> 2;
+    std::vector<sum_t> sums(((size_t)width + 3) * 4);
+    sum_t(*sum0)[4] = (sum_t(*)[4])sums.data();
+
+    for (auto _ : state)
+    {
+        for (int z = 0; z < height; z++)
+        {
+            const pixel *pix1 = plane.ref.data() + (size_t)4 * z * plane.width;
+            const pixel *pix2 = plane.dist.data() + (size_t)4 * z * plane.width;
+            for (int x = 0; x < width; x += 2)
+                dsp.ssim_4x4x2_core(&pix1[4 * x], plane.width, &pix2[4 * x], plane.width, &sum0[x]);
+            benchmark::DoNotOptimize(sum0);
+        }
+        benchmark::ClobberMemory();
+    }
+    set_pixels(state, plane.width, plane.height);
+}
+
+// 只计时end stage：一行块的和事先算好，每行都用同样的两行和
+template <int depth>
+static void BM_ssim_end4(benchmark::State &state)
+{
+    typedef typename PixelTraits<depth>::sum_t sum_t;
+    const SSIMDSPContext<depth> &dsp = ssim_dsp<depth>();
+    SyntheticPlane<depth> plane(state.range(0), state.range(1));
+    int width  = plane.width >> 2;
+    int height = plane.height >> 2;
+    std::vector<sum_t> sums(((size_t)width + 3) * 8);
+    sum_t(*sum0)[4] = (sum_t(*)[4])sums.data();
+    sum_t(*sum1)[4] = sum0 + width + 3;
+
+    for (int x = 0; x < width; x += 2)
+    {
+        dsp.ssim_4x4x2_core(&plane.ref[4 * x], plane.width, &plane.dist[4 * x], plane.width, &sum1[x]);
+        dsp.ssim_4x4x2_core(&plane.ref[4 * x + 4 * plane.width], plane.width,
+                            &plane.dist[4 * x + 4 * plane.width], plane.width, &sum0[x]);
+    }
+
+    for (auto _ : state)
+    {
+        float ssim = 0;
+        for (int y = 1; y < height; y++)
+        {
+            for (int x = 0; x < width - 1; x += 4)
+                ssim += dsp.ssim_end4(sum0 + x, sum1 + x, FFMIN(4, width - x - 1)).C_S;
+        }
+        benchmark::DoNotOptimize(ssim);
+    }
+    set_pixels(state, plane.width, plane.height);
+}
+
+// 与BM_ssim_end4相同，换成--fast-end的整行版本
+template <int depth>
+static void BM_ssim_end_fast(benchmark::State &state)
+{
+    typedef typename PixelTraits<depth>::sum_t sum_t;
+    const SSIMDSPContext<depth> &dsp = ssim_dsp<depth>();
+    SyntheticPlane<depth> plane(state.range(0), state.range(1));
+    int width  = plane.width >> 2;
+    int height = plane.height >> 2;
+    std::vector<sum_t> sums(((size_t)width + 3) * 8);
+    sum_t(*sum0)[4] = (sum_t(*)[4])sums.data();
+    sum_t(*sum1)[4] = sum0 + width + 3;
+
+    if (!dsp.ssim_end_fast)
+    {
+        state.SkipWithError("No fast end stage on this CPU/bit depth");
+        return;
+    }
+    for (int x = 0; x < width; x += 2)
+    {
+        dsp.ssim_4x4x2_core(&plane.ref[4 * x], plane.width, &plane.dist[4 * x], plane.width, &sum1[x]);
+        dsp.ssim_4x4x2_core(&plane.ref[4 * x + 4 * plane.width], plane.width,
+                            &plane.dist[4 * x + 4 * plane.width], plane.width, &sum0[x]);
+    }
+
+    for (auto _ : state)
+    {
+        float ssim = 0;
+        for (int y = 1; y < height; y++)
+            ssim += dsp.ssim_end_fast(sum0, sum1, width - 1).C_S;
+        benchmark::DoNotOptimize(ssim);
+    }
+    set_pixels(state, plane.width, plane.height);
+}
+
+template <int depth>
+static void BM_downsample_2x2_mean(benchmark::State &state)
+{
+    typedef typename PixelTraits<depth>::pixel pixel;
+    SyntheticPlane<depth> plane(state.range(0), state.range(1));
+    std::vector<pixel> out((size_t)(plane.width >> 1) * (plane.height >> 1));
+
+    for (auto _ : state)
+    {
+        downsample_2x2_mean(plane.ref.data(), plane.width, plane.width, plane.height, out.data());
+        benchmark::ClobberMemory();
+    }
+    set_pixels(state, plane.width, plane.height);
+}
+
+template <int depth>
+static void BM_ssim_plane(benchmark::State &state)
+{
+    typedef typename PixelTraits<depth>::sum_t sum_t;
+    SyntheticPlane<depth> plane(state.range(0), state.range(1));
+    std::vector<sum_t> temp(SSIM_TEMP_SIZE(plane.width));
+
+    for (auto _ : state)
+    {
+        ssim_value value = ssim_plane<depth>(plane.ref.data(), plane.width, plane.dist.data(), plane.width,
+                                             plane.width, plane.height, temp.data(), NULL);
+        benchmark::DoNotOptimize(value);
+    }
+    set_pixels(state, plane.width, plane.height);
+}
+
+// 第二个参数为1时是--tiled
+template <int depth>
+static void BM_ms_ssim_plane(benchmark::State &state)
+{
+    typedef typename PixelTraits<depth>::pixel pixel;
+    SyntheticPlane<depth> plane(state.range(0), state.range(1));
+    MSSSIMContext ctx;
+
+    if (ms_ssim_init(&ctx, plane.width, plane.height, depth, WINDOW_BLOCK, 1, 0, state.range(2)) < 0)
+    {
+        state.SkipWithError("Failed to allocate MS-SSIM context");
+        return;
+    }
+    for (auto _ : state)
+    {
+        float value = ms_ssim_plane(&ctx, (const uint8_t *)plane.ref.data(), plane.width * sizeof(pixel),
+                                    (const uint8_t *)plane.dist.data(), plane.width * sizeof(pixel),
+                                    plane.width, plane.height);
+        benchmark::DoNotOptimize(value);
+    }
+    ms_ssim_uninit(&ctx);
+    set_pixels(state, plane.width, plane.height);
+}
+
+static void resolutions(benchmark::internal::Benchmark *b)
+{
+    b->ArgNames({"w", "h"});
+    for (auto &r : RESOLUTIONS)
+        b->Args({r[0], r[1]});
+}
+
+static void resolutions_tiled(benchmark::internal::Benchmark *b)
+{
+    b->ArgNames({"w", "h", "tiled"});
+    for (int tiled = 0; tiled < 2; tiled++)
+        for (auto &r : RESOLUTIONS)
+            b->Args({r[0], r[1], tiled});
+}
+
+BENCHMARK_TEMPLATE(BM_ssim_4x4x2_core, 8)->Apply(resolutions);
+BENCHMARK_TEMPLATE(BM_ssim_4x4x2_core, 10)->Apply(resolutions);
+BENCHMARK_TEMPLATE(BM_ssim_end4, 8)->Apply(resolutions);
+BENCHMARK_TEMPLATE(BM_ssim_end4, 10)->Apply(resolutions);
+BENCHMARK_TEMPLATE(BM_ssim_end_fast, 8)->Apply(resolutions);
+BENCHMARK_TEMPLATE(BM_downsample_2x2_mean, 8)->Apply(resolutions);
+BENCHMARK_TEMPLATE(BM_downsample_2x2_mean, 10)->Apply(resolutions);
+BENCHMARK_TEMPLATE(BM_ssim_plane, 8)->Apply(resolutions);
+BENCHMARK_TEMPLATE(BM_ssim_plane, 10)->Apply(resolutions);
+BENCHMARK_TEMPLATE(BM_ms_ssim_plane, 8)->Apply(resolutions_tiled);
+BENCHMARK_TEMPLATE(BM_ms_ssim_plane, 10)->Apply(resolutions_tiled);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,78 @@
+/*
+ * msssim.cpp
+ * The library side of msssim.h: a thin wrapper that keeps an MSSSIMContext
+ * (msssim_core.h) per MSSSIM and scores the three planes of a frame with it,
+ * exactly as the ms-ssim CLI does with --all-metrics.
+ *
+ * g++ -O2 -pthread -c msssim.cpp && ar rcs libmsssim.a msssim.o
+ */
+#include "msssim.h"
+#include "msssim_core.h"
+
+struct MSSSIM
+{
+    MSSSIMContext ctx;
+    int           width;
+    int           height;
+};
+
+MSSSIM *msssim_alloc(int width, int height, const MSSSIMOptions *opts)
+{
+    MSSSIMOptions def = {8, MSSSIM_WINDOW_BLOCK, 1, 0, 0};
+    MSSSIM *m;
+
+    if (!opts)
+        opts = &def;
+    if (width <= 0 || height <= 0 || width * (int64_t)height >= INT_MAX / 3 ||
+        (opts->bit_depth != 8 && opts->bit_depth != 10 && opts->bit_depth != 12 && opts->bit_depth != 16) ||
+        (opts->window != MSSSIM_WINDOW_BLOCK && opts->window != MSSSIM_WINDOW_GAUSSIAN) || opts->band_threads < 0 ||
+        (opts->fast_end && opts->window != MSSSIM_WINDOW_BLOCK))
+        return NULL;
+
+    // 与命令行相同：高斯窗口在最小的尺度(色度平面下采样4次)上也要放得下
+    if (opts->window == MSSSIM_WINDOW_GAUSSIAN &&
+        ((width >> 1) >> (MAX_SCALE - 1) < GAUSS_TAPS || (height >> 1) >> (MAX_SCALE - 1) < GAUSS_TAPS))
+        return NULL;
+
+    m = (MSSSIM *)calloc(1, sizeof(*m));
+    if (!m)
+        return NULL;
+
+    int window = opts->window == MSSSIM_WINDOW_GAUSSIAN ? WINDOW_GAUSSIAN : WINDOW_BLOCK;
+    if (ms_ssim_init(&m->ctx, width, height, opts->bit_depth, window, FFMAX(opts->band_threads, 1), 0, opts->tiled, opts->fast_end) < 0)
+    {
+        free(m);
+        return NULL;
+    }
+    m->width  = width;
+    m->height = height;
+    return m;
+}
+
+int msssim_score_frame(MSSSIM *m,
+                       const uint8_t *const ref[3], const int ref_stride[3],
+                       const uint8_t *const dist[3], const int dist_stride[3],
+                       MSSSIMScore *score)
+{
+    if (!m || !ref || !dist || !ref_stride || !dist_stride || !score)
+        return -1;
+
+    for (int i = 0; i < 3; i++)
+    {
+        PlaneMetrics metrics;
+        score->ms_ssim[i] = ms_ssim_plane(&m->ctx, ref[i], ref_stride[i], dist[i], dist_stride[i],
+                                          m->width >> !!i, m->height >> !!i, MAX_SCALE, &metrics);
+        score->ssim[i] = metrics.ssim;
+        score->sse[i]  = metrics.sse;
+    }
+    return 0;
+}
+
+void msssim_free(MSSSIM **m)
+{
+    if (!m || !*m)
+        return;
+    ms_ssim_uninit(&(*m)->ctx);
+    free(*m);
+    *m = NULL;
+}
@@ -0,0 +1,72 @@
+/*
+ * msssim.h
+ * In-process MS-SSIM scoring, for callers that already have decoded frames
+ * (e.g. an encoder scoring its own reconstruction). The implementation is the
+ * same code the ms-ssim CLI runs (msssim_core.h), so scores are identical.
+ *
+ * Build the library and link against it:
+ *   g++ -O2 -pthread -c msssim.cpp && ar rcs libmsssim.a msssim.o
+ *   g++ -O2 my_encoder.cpp libmsssim.a -pthread
+ *
+ * A context is sized for one resolution and bit depth; all buffers are
+ * allocated by msssim_alloc(), so scoring does no allocation. A context may
+ * be used by one thread at a time; use one context per thread to score
+ * frames in parallel.
+ */
+#ifndef MSSSIM_H
+#define MSSSIM_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct MSSSIM MSSSIM;
+
+enum
+{
+    MSSSIM_WINDOW_BLOCK    = 0, // overlapped 8x8 block sums (x264 style, the default)
+    MSSSIM_WINDOW_GAUSSIAN = 1, // 11x11 gaussian, sigma 1.5, as in the paper
+};
+
+typedef struct
+{
+    int bit_depth;    // 8, 10, 12 or 16; samples deeper than 8 bits are uint16_t
+    int window;       // MSSSIM_WINDOW_*
+    int band_threads; // > 1 splits each plane into row bands scored in parallel
+    int tiled;        // cache-blocked pyramid (block window, band_threads <= 1)
+    int fast_end;     // approximate end stage, not bit-exact (8-bit block window on AVX2)
+} MSSSIMOptions;
+
+typedef struct
+{
+    float    ms_ssim[3]; // Y, U, V
+    float    ssim[3];    // single-scale SSIM (the scale-1 pass)
+    uint64_t sse[3];     // sum of squared differences, for PSNR
+} MSSSIMScore;
+
+/*
+ * width/height are the luma size of 4:2:0 frames. opts may be NULL for 8-bit
+ * with the block window. Returns NULL on invalid parameters or out of memory.
+ */
+MSSSIM *msssim_alloc(int width, int height, const MSSSIMOptions *opts);
+
+/*
+ * Scores one 4:2:0 frame. ref/dist point to the Y, U and V planes, and the
+ * strides are in bytes (e.g. AVFrame linesize). The kernels may read up to
+ * 32 bytes past the end of each plane's last row, so that memory must be
+ * readable (padded frame buffers such as AVFrame's are). Returns 0 on success.
+ */
+int msssim_score_frame(MSSSIM *ctx,
+                       const uint8_t *const ref[3], const int ref_stride[3],
+                       const uint8_t *const dist[3], const int dist_stride[3],
+                       MSSSIMScore *score);
+
+void msssim_free(MSSSIM **ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MSSSIM_H */
@@ -0,0 +1,1935 @@
+/*
+ * Copyright (c) 2003-2013 Loren Merritt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110 USA
+ */
+/*
+ * msssim_core.h
+ * The MS-SSIM scoring core shared by the ms-ssim CLI (test_msssim.cpp), the
+ * library (msssim.cpp, public API in msssim.h) and the kernel benchmark
+ * (bench_msssim.cpp): the SIMD kernels and their dispatch, the block and
+ * gaussian windows, the preallocated pyramid context, row-band and tiled
+ * execution, and ms_ssim_plane(). Everything is static or a template, so
+ * each program compiles its own copy and the CLI still builds from one file.
+ */
+#ifndef MSSSIM_CORE_H
+#define MSSSIM_CORE_H
+
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <cstring>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#if !defined(MSSSIM_NO_SIMD) && (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define ARCH_X86 1
+#include <immintrin.h>
+#elif !defined(MSSSIM_NO_SIMD) && defined(__aarch64__)
+#define ARCH_AARCH64 1
+#include <arm_neon.h>
+#endif
+
+#define FFSWAP(type, a, b) \
+    do                     \
+    {                      \
+        type SWAP_tmp = b; \
+        b = a;             \
+        a = SWAP_tmp;      \
+    } while (0)
+#define FFMIN(a, b) ((a) > (b) ? (b) : (a))
+#define FFMAX(a, b) ((a) > (b) ? (a) : (b))
+
+/*
+ * 位深(使用几位来定位一个像素点，8位的话像素值范围就是0-255)在运行时由--bitdepth指定，
+ * 计算相关的函数都是以位深为参数的模板，每个位深各实例化一份：
+ * 8位用uint8_t和纯整数的ssim_end1，更高的位深用uint16_t，
+ * 位深大于9时ssim_end1改用double防止溢出，16位时4x4块的和也需要64位。
+ */
+template <int depth>
+struct PixelTraits
+{
+    typedef typename std::conditional<(depth > 8), uint16_t, uint8_t>::type pixel; // 表示像素值
+    typedef typename std::conditional<(depth > 12), int64_t, int>::type sum_t;      // 4x4块的和
+    static const int pixel_max = (1 << depth) - 1;                                  // 像素值最大值 公式里的L
+};
+
+const float WEIGHT[] = {0.0448, 0.2856, 0.3001, 0.2363, 0.1333};
+
+typedef struct
+{
+    float L;
+    float C_S;
+    float S;   // L*C_S，即单尺度的ssim
+} ssim_value;
+
+// --all-metrics：第1层计算ssim时顺便得到的单尺度ssim和psnr需要的sse
+typedef struct
+{
+    uint64_t sse;
+    float    ssim;
+} PlaneMetrics;
+
+/****************************************************************************
+ * structural similarity metric
+ ****************************************************************************/
+template <int depth, typename pixel = typename PixelTraits<depth>::pixel, typename sum_t = typename PixelTraits<depth>::sum_t>
+static void ssim_4x4x2_core_c(const pixel *pix1, intptr_t stride1,
+                              const pixel *pix2, intptr_t stride2,
+                              sum_t sums[2][4])
+{
+    int x, y, z;
+
+    for (z = 0; z < 2; z++)
+    {
+        sum_t s1 = 0, s2 = 0, ss = 0, s12 = 0;
+        for (y = 0; y < 4; y++)
+            for (x = 0; x < 4; x++)
+            {
+                sum_t a = pix1[x + y * stride1];
+                sum_t b = pix2[x + y * stride2];
+                s1 += a;
+                s2 += b;
+                ss += a * a;
+                ss += b * b;
+                s12 += a * b;
+            }
+        sums[z][0] = s1;
+        sums[z][1] = s2;
+        sums[z][2] = ss;
+        sums[z][3] = s12;
+        pix1 += 4;
+        pix2 += 4;
+    }
+}
+
+template <int depth, typename sum_t = typename PixelTraits<depth>::sum_t>
+static ssim_value ssim_end1(sum_t s1, sum_t s2, sum_t ss, sum_t s12)
+{
+    static const int PIXEL_MAX = PixelTraits<depth>::pixel_max;
+    ssim_value value;
+/* Maximum value for 10-bit is: ss*64 = (2^10-1)^2*16*4*64 = 4286582784, which will overflow in some cases.
+ * s1*s1, s2*s2, and s1*s2 also obtain this value for edge cases: ((2^10-1)*16*4)^2 = 4286582784.
+ * Maximum value for 9-bit is: ss*64 = (2^9-1)^2*16*4*64 = 1069551616, which will not overflow. */
+    typedef typename std::conditional<(depth > 9), double, int>::type type;
+    // k1=0.01, k2=0.03，整数时四舍五入
+    static const type ssim_c1 = depth > 9 ? (type)(.01 * .01 * PIXEL_MAX * PIXEL_MAX * 64 * 64)
+                                          : (type)(int)(.01 * .01 * PIXEL_MAX * PIXEL_MAX * 64 * 64 + .5);
+    static const type ssim_c2 = depth > 9 ? (type)(.03 * .03 * PIXEL_MAX * PIXEL_MAX * 64 * 63)
+                                          : (type)(int)(.03 * .03 * PIXEL_MAX * PIXEL_MAX * 64 * 63 + .5);
+    type fs1 = s1;
+    type fs2 = s2;
+    type fss = ss;
+    type fs12 = s12;
+    type vars = fss * 64 - fs1 * fs1 - fs2 * fs2;
+    type covar = fs12 * 64 - fs1 * fs2;
+    
+    value.L = (float)(2 * fs1 * fs2 + ssim_c1) / (float)(fs1 * fs1 + fs2 * fs2 + ssim_c1);
+    value.C_S = (float)(2 * covar + ssim_c2) / (float)(vars + ssim_c2);
+    value.S = value.L * value.C_S;
+
+    return value;
+}
+
+template <int depth, typename sum_t = typename PixelTraits<depth>::sum_t>
+static ssim_value ssim_end4_c(sum_t sum0[5][4], sum_t sum1[5][4], int width)
+{
+    ssim_value ssim;
+    ssim.L = 0.0;
+    ssim.C_S = 0.0;
+    ssim.S = 0.0;
+
+    int i;
+    for (i = 0; i < width; i++)
+    {
+        ssim_value tmp;
+        tmp = ssim_end1<depth>(sum0[i][0] + sum0[i + 1][0] + sum1[i][0] + sum1[i + 1][0],
+                        sum0[i][1] + sum0[i + 1][1] + sum1[i][1] + sum1[i + 1][1],
+                        sum0[i][2] + sum0[i + 1][2] + sum1[i][2] + sum1[i + 1][2],
+                        sum0[i][3] + sum0[i + 1][3] + sum1[i][3] + sum1[i + 1][3]);
+        ssim.L   += tmp.L;
+        ssim.C_S += tmp.C_S;
+        ssim.S   += tmp.S;
+    }
+
+    return ssim;
+}
+
+#if ARCH_X86
+/*
+ * 两个相邻4x4块共8个像素宽，每行用pmovzxbw扩展为8个16位数，
+ * pmaddwd得到相邻像素对的和，最后再用phaddd把像素对合并成每个块的和。
+ */
+__attribute__((target("sse4.1")))
+static void ssim_4x4x2_core_sse4(const uint8_t *pix1, intptr_t stride1,
+                                 const uint8_t *pix2, intptr_t stride2,
+                                 int sums[2][4])
+{
+    const __m128i one = _mm_set1_epi16(1);
+    __m128i s1 = _mm_setzero_si128();
+    __m128i s2 = _mm_setzero_si128();
+    __m128i ss = _mm_setzero_si128();
+    __m128i s12 = _mm_setzero_si128();
+
+    for (int y = 0; y < 4; y++)
+    {
+        __m128i a = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(pix1 + y * stride1)));
+        __m128i b = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(pix2 + y * stride2)));
+        s1  = _mm_add_epi16(s1, a); // 4行之和最大为4*255，16位不会溢出
+        s2  = _mm_add_epi16(s2, b);
+        ss  = _mm_add_epi32(ss, _mm_madd_epi16(a, a));
+        ss  = _mm_add_epi32(ss, _mm_madd_epi16(b, b));
+        s12 = _mm_add_epi32(s12, _mm_madd_epi16(a, b));
+    }
+
+    s1 = _mm_madd_epi16(s1, one);
+    s2 = _mm_madd_epi16(s2, one);
+
+    // t0 = {s1[0], s1[1], s2[0], s2[1]}, t1 = {ss[0], ss[1], s12[0], s12[1]}
+    __m128i t0 = _mm_hadd_epi32(s1, s2);
+    __m128i t1 = _mm_hadd_epi32(ss, s12);
+    __m128i lo = _mm_unpacklo_epi32(t0, t1);
+    __m128i hi = _mm_unpackhi_epi32(t0, t1);
+    _mm_storeu_si128((__m128i *)sums[0], _mm_unpacklo_epi32(lo, hi));
+    _mm_storeu_si128((__m128i *)sums[1], _mm_unpackhi_epi32(lo, hi));
+}
+
+/*
+ * 与SSE4.1版本相同，只是一条256位指令同时处理两行。
+ */
+__attribute__((target("avx2")))
+static void ssim_4x4x2_core_avx2(const uint8_t *pix1, intptr_t stride1,
+                                 const uint8_t *pix2, intptr_t stride2,
+                                 int sums[2][4])
+{
+    const __m256i one = _mm256_set1_epi16(1);
+    __m256i s1 = _mm256_setzero_si256();
+    __m256i s2 = _mm256_setzero_si256();
+    __m256i ss = _mm256_setzero_si256();
+    __m256i s12 = _mm256_setzero_si256();
+
+    for (int y = 0; y < 4; y += 2)
+    {
+        __m128i a8 = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)(pix1 + y * stride1)),
+                                        _mm_loadl_epi64((const __m128i *)(pix1 + (y + 1) * stride1)));
+        __m128i b8 = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)(pix2 + y * stride2)),
+                                        _mm_loadl_epi64((const __m128i *)(pix2 + (y + 1) * stride2)));
+        __m256i a = _mm256_cvtepu8_epi16(a8);
+        __m256i b = _mm256_cvtepu8_epi16(b8);
+        s1  = _mm256_add_epi16(s1, a);
+        s2  = _mm256_add_epi16(s2, b);
+        ss  = _mm256_add_epi32(ss, _mm256_madd_epi16(a, a));
+        ss  = _mm256_add_epi32(ss, _mm256_madd_epi16(b, b));
+        s12 = _mm256_add_epi32(s12, _mm256_madd_epi16(a, b));
+    }
+
+    s1 = _mm256_madd_epi16(s1, one);
+    s2 = _mm256_madd_epi16(s2, one);
+
+    // 高128位是奇数行，与低128位相加后同SSE4.1版本
+    __m128i t0 = _mm_hadd_epi32(_mm_add_epi32(_mm256_castsi256_si128(s1), _mm256_extracti128_si256(s1, 1)),
+                                _mm_add_epi32(_mm256_castsi256_si128(s2), _mm256_extracti128_si256(s2, 1)));
+    __m128i t1 = _mm_hadd_epi32(_mm_add_epi32(_mm256_castsi256_si128(ss), _mm256_extracti128_si256(ss, 1)),
+                                _mm_add_epi32(_mm256_castsi256_si128(s12), _mm256_extracti128_si256(s12, 1)));
+    __m128i lo = _mm_unpacklo_epi32(t0, t1);
+    __m128i hi = _mm_unpackhi_epi32(t0, t1);
+    _mm_storeu_si128((__m128i *)sums[0], _mm_unpacklo_epi32(lo, hi));
+    _mm_storeu_si128((__m128i *)sums[1], _mm_unpackhi_epi32(lo, hi));
+}
+
+/*
+ * 9~12位的像素本身就是16位，直接加载，其余同8位的版本。
+ * 4行之和最大为4*4095，平方和的像素对最大为2*4095*4095，都不会溢出。
+ */
+__attribute__((target("sse4.1")))
+static void ssim_4x4x2_core_sse4(const uint16_t *pix1, intptr_t stride1,
+                                 const uint16_t *pix2, intptr_t stride2,
+                                 int sums[2][4])
+{
+    const __m128i one = _mm_set1_epi16(1);
+    __m128i s1 = _mm_setzero_si128();
+    __m128i s2 = _mm_setzero_si128();
+    __m128i ss = _mm_setzero_si128();
+    __m128i s12 = _mm_setzero_si128();
+
+    for (int y = 0; y < 4; y++)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(pix1 + y * stride1));
+        __m128i b = _mm_loadu_si128((const __m128i *)(pix2 + y * stride2));
+        s1  = _mm_add_epi16(s1, a);
+        s2  = _mm_add_epi16(s2, b);
+        ss  = _mm_add_epi32(ss, _mm_madd_epi16(a, a));
+        ss  = _mm_add_epi32(ss, _mm_madd_epi16(b, b));
+        s12 = _mm_add_epi32(s12, _mm_madd_epi16(a, b));
+    }
+
+    s1 = _mm_madd_epi16(s1, one);
+    s2 = _mm_madd_epi16(s2, one);
+
+    __m128i t0 = _mm_hadd_epi32(s1, s2);
+    __m128i t1 = _mm_hadd_epi32(ss, s12);
+    __m128i lo = _mm_unpacklo_epi32(t0, t1);
+    __m128i hi = _mm_unpackhi_epi32(t0, t1);
+    _mm_storeu_si128((__m128i *)sums[0], _mm_unpacklo_epi32(lo, hi));
+    _mm_storeu_si128((__m128i *)sums[1], _mm_unpackhi_epi32(lo, hi));
+}
+
+__attribute__((target("avx2")))
+static void ssim_4x4x2_core_avx2(const uint16_t *pix1, intptr_t stride1,
+                                 const uint16_t *pix2, intptr_t stride2,
+                                 int sums[2][4])
+{
+    const __m256i one = _mm256_set1_epi16(1);
+    __m256i s1 = _mm256_setzero_si256();
+    __m256i s2 = _mm256_setzero_si256();
+    __m256i ss = _mm256_setzero_si256();
+    __m256i s12 = _mm256_setzero_si256();
+
+    for (int y = 0; y < 4; y += 2)
+    {
+        __m256i a = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(pix1 + y * stride1))),
+                                            _mm_loadu_si128((const __m128i *)(pix1 + (y + 1) * stride1)), 1);
+        __m256i b = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(pix2 + y * stride2))),
+                                            _mm_loadu_si128((const __m128i *)(pix2 + (y + 1) * stride2)), 1);
+        s1  = _mm256_add_epi16(s1, a);
+        s2  = _mm256_add_epi16(s2, b);
+        ss  = _mm256_add_epi32(ss, _mm256_madd_epi16(a, a));
+        ss  = _mm256_add_epi32(ss, _mm256_madd_epi16(b, b));
+        s12 = _mm256_add_epi32(s12, _mm256_madd_epi16(a, b));
+    }
+
+    s1 = _mm256_madd_epi16(s1, one);
+    s2 = _mm256_madd_epi16(s2, one);
+
+    __m128i t0 = _mm_hadd_epi32(_mm_add_epi32(_mm256_castsi256_si128(s1), _mm256_extracti128_si256(s1, 1)),
+                                _mm_add_epi32(_mm256_castsi256_si128(s2), _mm256_extracti128_si256(s2, 1)));
+    __m128i t1 = _mm_hadd_epi32(_mm_add_epi32(_mm256_castsi256_si128(ss), _mm256_extracti128_si256(ss, 1)),
+                                _mm_add_epi32(_mm256_castsi256_si128(s12), _mm256_extracti128_si256(s12, 1)));
+    __m128i lo = _mm_unpacklo_epi32(t0, t1);
+    __m128i hi = _mm_unpackhi_epi32(t0, t1);
+    _mm_storeu_si128((__m128i *)sums[0], _mm_unpacklo_epi32(lo, hi));
+    _mm_storeu_si128((__m128i *)sums[1], _mm_unpackhi_epi32(lo, hi));
+}
+
+/*
+ * 一次算4个窗口的ssim_end1：整数部分与C版本完全相同，
+ * 除法用divps，IEEE保证与标量除法逐位一致，最后按窗口顺序累加。
+ * ssim_end4每次最多只有4个窗口，所以没有256位版本。
+ */
+__attribute__((target("sse4.1")))
+static ssim_value ssim_end4_sse4(int sum0[5][4], int sum1[5][4], int width)
+{
+    static const int PIXEL_MAX = PixelTraits<8>::pixel_max; // 只用于8位
+    static const int ssim_c1 = (int)(.01 * .01 * PIXEL_MAX * PIXEL_MAX * 64 * 64 + .5);
+    static const int ssim_c2 = (int)(.03 * .03 * PIXEL_MAX * PIXEL_MAX * 64 * 63 + .5);
+    __m128i a[5];
+    for (int i = 0; i < 5; i++)
+        a[i] = _mm_add_epi32(_mm_loadu_si128((const __m128i *)sum0[i]),
+                             _mm_loadu_si128((const __m128i *)sum1[i]));
+
+    // 每个窗口是{s1, s2, ss, s12}，转置成每个分量一个向量
+    __m128 w0 = _mm_castsi128_ps(_mm_add_epi32(a[0], a[1]));
+    __m128 w1 = _mm_castsi128_ps(_mm_add_epi32(a[1], a[2]));
+    __m128 w2 = _mm_castsi128_ps(_mm_add_epi32(a[2], a[3]));
+    __m128 w3 = _mm_castsi128_ps(_mm_add_epi32(a[3], a[4]));
+    _MM_TRANSPOSE4_PS(w0, w1, w2, w3);
+    __m128i s1  = _mm_castps_si128(w0);
+    __m128i s2  = _mm_castps_si128(w1);
+    __m128i ss  = _mm_castps_si128(w2);
+    __m128i s12 = _mm_castps_si128(w3);
+
+    const __m128i c1 = _mm_set1_epi32(ssim_c1);
+    const __m128i c2 = _mm_set1_epi32(ssim_c2);
+    __m128i s1s1 = _mm_mullo_epi32(s1, s1);
+    __m128i s2s2 = _mm_mullo_epi32(s2, s2);
+    __m128i s1s2 = _mm_mullo_epi32(s1, s2);
+    __m128i vars  = _mm_sub_epi32(_mm_sub_epi32(_mm_slli_epi32(ss, 6), s1s1), s2s2);
+    __m128i covar = _mm_sub_epi32(_mm_slli_epi32(s12, 6), s1s2);
+
+    __m128 l = _mm_div_ps(_mm_cvtepi32_ps(_mm_add_epi32(_mm_add_epi32(s1s2, s1s2), c1)),
+                          _mm_cvtepi32_ps(_mm_add_epi32(_mm_add_epi32(s1s1, s2s2), c1)));
+    __m128 cs = _mm_div_ps(_mm_cvtepi32_ps(_mm_add_epi32(_mm_add_epi32(covar, covar), c2)),
+                           _mm_cvtepi32_ps(_mm_add_epi32(vars, c2)));
+
+    float lv[4], csv[4];
+    _mm_storeu_ps(lv, l);
+    _mm_storeu_ps(csv, cs);
+
+    ssim_value ssim;
+    ssim.L = 0.0;
+    ssim.C_S = 0.0;
+    ssim.S = 0.0;
+    for (int i = 0; i < width; i++)
+    {
+        ssim.L   += lv[i];
+        ssim.C_S += csv[i];
+        ssim.S   += lv[i] * csv[i];
+    }
+
+    return ssim;
+}
+/*
+ * --fast-end：一次算一整行窗口的end stage，8个窗口一组放在AVX2的8个通道里，两个除法
+ * 换成rcpps加一次牛顿迭代r*(2 - d*r)。rcpps的相对误差不超过1.5*2^-12，迭代之后约为
+ * 2^-23，加上几次乘法的舍入，每个窗口的L和C_S与除法的相对误差不超过2^-21。
+ * 累加按通道分开，顺序也与逐窗口累加不同，所以结果与默认路径不逐位一致，
+ * 每个平面的MS-SSIM相差不超过几个1e-7。
+ * 凑不满8个的窗口把剩下的和复制到补0的缓冲里，照样算一组，多出的通道用掩码去掉。
+ * 不在这里调用ssim_end1：非VEX的代码夹在ymm寄存器中间会有AVX/SSE切换的代价。
+ * 只有8位有这个版本，更高位深的end stage是double的。
+ */
+__attribute__((target("avx2")))
+static inline __m256 rcp_nr_avx2(__m256 d)
+{
+    __m256 r = _mm256_rcp_ps(d);
+    return _mm256_mul_ps(r, _mm256_sub_ps(_mm256_set1_ps(2.0f), _mm256_mul_ps(d, r)));
+}
+
+// 第0到7个窗口的L和C_S，用到sum0/sum1的第0到8个块的和。通道的顺序是窗口0,2,4,6,1,3,5,7
+__attribute__((target("avx2")))
+static inline void ssim_end8_avx2(const int sum0[][4], const int sum1[][4], __m256 *l, __m256 *cs)
+{
+    static const int PIXEL_MAX = PixelTraits<8>::pixel_max;
+    static const int ssim_c1 = (int)(.01 * .01 * PIXEL_MAX * PIXEL_MAX * 64 * 64 + .5);
+    static const int ssim_c2 = (int)(.03 * .03 * PIXEL_MAX * PIXEL_MAX * 64 * 63 + .5);
+    const __m256i c1 = _mm256_set1_epi32(ssim_c1);
+    const __m256i c2 = _mm256_set1_epi32(ssim_c2);
+
+    // r[k]是第2k、2k+1个窗口的{s1, s2, ss, s12}
+    __m256i r[4];
+    for (int k = 0; k < 4; k++)
+    {
+        const int *p0 = sum0[2 * k];
+        const int *p1 = sum1[2 * k];
+        r[k] = _mm256_add_epi32(_mm256_add_epi32(_mm256_loadu_si256((const __m256i *)p0), _mm256_loadu_si256((const __m256i *)p1)),
+                                _mm256_add_epi32(_mm256_loadu_si256((const __m256i *)(p0 + 4)), _mm256_loadu_si256((const __m256i *)(p1 + 4))));
+    }
+
+    // 每128位内转置
+    __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+    __m256i t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+    __m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+    __m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+    __m256i s1  = _mm256_unpacklo_epi64(t0, t2);
+    __m256i s2  = _mm256_unpackhi_epi64(t0, t2);
+    __m256i ss  = _mm256_unpacklo_epi64(t1, t3);
+    __m256i s12 = _mm256_unpackhi_epi64(t1, t3);
+
+    __m256i s1s1 = _mm256_mullo_epi32(s1, s1);
+    __m256i s2s2 = _mm256_mullo_epi32(s2, s2);
+    __m256i s1s2 = _mm256_mullo_epi32(s1, s2);
+    __m256i vars  = _mm256_sub_epi32(_mm256_sub_epi32(_mm256_slli_epi32(ss, 6), s1s1), s2s2);
+    __m256i covar = _mm256_sub_epi32(_mm256_slli_epi32(s12, 6), s1s2);
+
+    *l  = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_add_epi32(s1s2, s1s2), c1)),
+                        rcp_nr_avx2(_mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_add_epi32(s1s1, s2s2), c1))));
+    *cs = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_add_epi32(covar, covar), c2)),
+                        rcp_nr_avx2(_mm256_cvtepi32_ps(_mm256_add_epi32(vars, c2))));
+}
+
+__attribute__((target("avx2")))
+static ssim_value ssim_end_fast_avx2(int sum0[][4], int sum1[][4], int count)
+{
+    __m256 acc_l  = _mm256_setzero_ps();
+    __m256 acc_cs = _mm256_setzero_ps();
+    __m256 acc_s  = _mm256_setzero_ps();
+    __m256 l, cs;
+    int x = 0;
+
+    // 8个窗口用到第x到x+8个块的和，不会越过这一行
+    for (; x + 8 <= count; x += 8)
+    {
+        ssim_end8_avx2(sum0 + x, sum1 + x, &l, &cs);
+        acc_l  = _mm256_add_ps(acc_l, l);
+        acc_cs = _mm256_add_ps(acc_cs, cs);
+        acc_s  = _mm256_add_ps(acc_s, _mm256_mul_ps(l, cs));
+    }
+
+    if (x < count)
+    {
+        int n = count - x;
+        int tail0[9][4] = {{0}};
+        int tail1[9][4] = {{0}};
+        memcpy(tail0, sum0 + x, (n + 1) * sizeof(*tail0));
+        memcpy(tail1, sum1 + x, (n + 1) * sizeof(*tail1));
+        ssim_end8_avx2(tail0, tail1, &l, &cs);
+
+        // 通道i是第idx[i]个窗口，只留下前n个
+        __m256 mask = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(n), _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7)));
+        l  = _mm256_and_ps(l, mask);
+        cs = _mm256_and_ps(cs, mask);
+        acc_l  = _mm256_add_ps(acc_l, l);
+        acc_cs = _mm256_add_ps(acc_cs, cs);
+        acc_s  = _mm256_add_ps(acc_s, _mm256_mul_ps(l, cs));
+    }
+
+    float lv[8], csv[8], sv[8];
+    _mm256_storeu_ps(lv, acc_l);
+    _mm256_storeu_ps(csv, acc_cs);
+    _mm256_storeu_ps(sv, acc_s);
+
+    ssim_value ssim;
+    ssim.L = 0.0;
+    ssim.C_S = 0.0;
+    ssim.S = 0.0;
+    for (int i = 0; i < 8; i++)
+    {
+        ssim.L   += lv[i];
+        ssim.C_S += csv[i];
+        ssim.S   += sv[i];
+    }
+    return ssim;
+}
+#endif
+
+#if ARCH_AARCH64
+static void ssim_4x4x2_core_neon(const uint8_t *pix1, intptr_t stride1,
+                                 const uint8_t *pix2, intptr_t stride2,
+                                 int sums[2][4])
+{
+    uint16x8_t s1 = vdupq_n_u16(0);
+    uint16x8_t s2 = vdupq_n_u16(0);
+    uint32x4_t ss[2]  = {vdupq_n_u32(0), vdupq_n_u32(0)};
+    uint32x4_t s12[2] = {vdupq_n_u32(0), vdupq_n_u32(0)};
+
+    for (int y = 0; y < 4; y++)
+    {
+        uint16x8_t a = vmovl_u8(vld1_u8(pix1 + y * stride1));
+        uint16x8_t b = vmovl_u8(vld1_u8(pix2 + y * stride2));
+        s1 = vaddq_u16(s1, a);
+        s2 = vaddq_u16(s2, b);
+        ss[0]  = vmlal_u16(ss[0], vget_low_u16(a), vget_low_u16(a));
+        ss[0]  = vmlal_u16(ss[0], vget_low_u16(b), vget_low_u16(b));
+        ss[1]  = vmlal_high_u16(ss[1], a, a);
+        ss[1]  = vmlal_high_u16(ss[1], b, b);
+        s12[0] = vmlal_u16(s12[0], vget_low_u16(a), vget_low_u16(b));
+        s12[1] = vmlal_high_u16(s12[1], a, b);
+    }
+
+    sums[0][0] = vaddlv_u16(vget_low_u16(s1));
+    sums[0][1] = vaddlv_u16(vget_low_u16(s2));
+    sums[0][2] = vaddvq_u32(ss[0]);
+    sums[0][3] = vaddvq_u32(s12[0]);
+    sums[1][0] = vaddlv_u16(vget_high_u16(s1));
+    sums[1][1] = vaddlv_u16(vget_high_u16(s2));
+    sums[1][2] = vaddvq_u32(ss[1]);
+    sums[1][3] = vaddvq_u32(s12[1]);
+}
+
+static void ssim_4x4x2_core_neon(const uint16_t *pix1, intptr_t stride1,
+                                 const uint16_t *pix2, intptr_t stride2,
+                                 int sums[2][4])
+{
+    uint16x8_t s1 = vdupq_n_u16(0);
+    uint16x8_t s2 = vdupq_n_u16(0);
+    uint32x4_t ss[2]  = {vdupq_n_u32(0), vdupq_n_u32(0)};
+    uint32x4_t s12[2] = {vdupq_n_u32(0), vdupq_n_u32(0)};
+
+    for (int y = 0; y < 4; y++)
+    {
+        uint16x8_t a = vld1q_u16(pix1 + y * stride1);
+        uint16x8_t b = vld1q_u16(pix2 + y * stride2);
+        s1 = vaddq_u16(s1, a);
+        s2 = vaddq_u16(s2, b);
+        ss[0]  = vmlal_u16(ss[0], vget_low_u16(a), vget_low_u16(a));
+        ss[0]  = vmlal_u16(ss[0], vget_low_u16(b), vget_low_u16(b));
+        ss[1]  = vmlal_high_u16(ss[1], a, a);
+        ss[1]  = vmlal_high_u16(ss[1], b, b);
+        s12[0] = vmlal_u16(s12[0], vget_low_u16(a), vget_low_u16(b));
+        s12[1] = vmlal_high_u16(s12[1], a, b);
+    }
+
+    sums[0][0] = vaddlv_u16(vget_low_u16(s1));
+    sums[0][1] = vaddlv_u16(vget_low_u16(s2));
+    sums[0][2] = vaddvq_u32(ss[0]);
+    sums[0][3] = vaddvq_u32(s12[0]);
+    sums[1][0] = vaddlv_u16(vget_high_u16(s1));
+    sums[1][1] = vaddlv_u16(vget_high_u16(s2));
+    sums[1][2] = vaddvq_u32(ss[1]);
+    sums[1][3] = vaddvq_u32(s12[1]);
+}
+
+static ssim_value ssim_end4_neon(int sum0[5][4], int sum1[5][4], int width)
+{
+    static const int PIXEL_MAX = PixelTraits<8>::pixel_max; // 只用于8位
+    static const int ssim_c1 = (int)(.01 * .01 * PIXEL_MAX * PIXEL_MAX * 64 * 64 + .5);
+    static const int ssim_c2 = (int)(.03 * .03 * PIXEL_MAX * PIXEL_MAX * 64 * 63 + .5);
+    int32x4_t a[5];
+    int w[4][4];
+    for (int i = 0; i < 5; i++)
+        a[i] = vaddq_s32(vld1q_s32(sum0[i]), vld1q_s32(sum1[i]));
+    for (int i = 0; i < 4; i++)
+        vst1q_s32(w[i], vaddq_s32(a[i], a[i + 1]));
+
+    // vld4q按{s1, s2, ss, s12}解交织，相当于转置
+    int32x4x4_t t = vld4q_s32(&w[0][0]);
+    int32x4_t s1 = t.val[0], s2 = t.val[1], ss = t.val[2], s12 = t.val[3];
+
+    const int32x4_t c1 = vdupq_n_s32(ssim_c1);
+    const int32x4_t c2 = vdupq_n_s32(ssim_c2);
+    int32x4_t s1s1 = vmulq_s32(s1, s1);
+    int32x4_t s2s2 = vmulq_s32(s2, s2);
+    int32x4_t s1s2 = vmulq_s32(s1, s2);
+    int32x4_t vars  = vsubq_s32(vsubq_s32(vshlq_n_s32(ss, 6), s1s1), s2s2);
+    int32x4_t covar = vsubq_s32(vshlq_n_s32(s12, 6), s1s2);
+
+    float32x4_t l = vdivq_f32(vcvtq_f32_s32(vaddq_s32(vaddq_s32(s1s2, s1s2), c1)),
+                              vcvtq_f32_s32(vaddq_s32(vaddq_s32(s1s1, s2s2), c1)));
+    float32x4_t cs = vdivq_f32(vcvtq_f32_s32(vaddq_s32(vaddq_s32(covar, covar), c2)),
+                               vcvtq_f32_s32(vaddq_s32(vars, c2)));
+
+    float lv[4], csv[4];
+    vst1q_f32(lv, l);
+    vst1q_f32(csv, cs);
+
+    ssim_value ssim;
+    ssim.L = 0.0;
+    ssim.C_S = 0.0;
+    ssim.S = 0.0;
+    for (int i = 0; i < width; i++)
+    {
+        ssim.L   += lv[i];
+        ssim.C_S += csv[i];
+        ssim.S   += lv[i] * csv[i];
+    }
+
+    return ssim;
+}
+#endif
+
+template <int depth>
+struct SSIMDSPContext
+{
+    typedef typename PixelTraits<depth>::pixel pixel;
+    typedef typename PixelTraits<depth>::sum_t sum_t;
+
+    void (*ssim_4x4x2_core)(const pixel *pix1, intptr_t stride1,
+                            const pixel *pix2, intptr_t stride2,
+                            sum_t sums[2][4]);
+    ssim_value (*ssim_end4)(sum_t sum0[5][4], sum_t sum1[5][4], int width);
+    // --fast-end：一次算一行count个窗口，不逐位一致，NULL表示没有
+    ssim_value (*ssim_end_fast)(sum_t sum0[][4], sum_t sum1[][4], int count);
+};
+
+// 16位只有C版本
+template <int depth>
+static void ssim_dsp_init_arch(SSIMDSPContext<depth> *dsp)
+{
+}
+
+// 8位的ssim_4x4x2_core和ssim_end4都有SIMD版本
+static void ssim_dsp_init_arch(SSIMDSPContext<8> *dsp)
+{
+#if ARCH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        dsp->ssim_4x4x2_core = ssim_4x4x2_core_sse4;
+        dsp->ssim_end4       = ssim_end4_sse4;
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        dsp->ssim_4x4x2_core = ssim_4x4x2_core_avx2;
+        dsp->ssim_end_fast   = ssim_end_fast_avx2;
+    }
+#elif ARCH_AARCH64
+    dsp->ssim_4x4x2_core = ssim_4x4x2_core_neon;
+    dsp->ssim_end4       = ssim_end4_neon;
+#endif
+}
+
+// 10/12位的块求和与8位一样是32位整数，可以用SIMD；ssim_end4是double版本，只有C
+template <int depth>
+static void ssim_dsp_init_arch_16(SSIMDSPContext<depth> *dsp)
+{
+#if ARCH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1"))
+        dsp->ssim_4x4x2_core = ssim_4x4x2_core_sse4;
+    if (__builtin_cpu_supports("avx2"))
+        dsp->ssim_4x4x2_core = ssim_4x4x2_core_avx2;
+#elif ARCH_AARCH64
+    dsp->ssim_4x4x2_core = ssim_4x4x2_core_neon;
+#endif
+}
+
+static void ssim_dsp_init_arch(SSIMDSPContext<10> *dsp) { ssim_dsp_init_arch_16(dsp); }
+static void ssim_dsp_init_arch(SSIMDSPContext<12> *dsp) { ssim_dsp_init_arch_16(dsp); }
+
+// 按CPU支持的指令集选择最快的实现，C版本兜底
+template <int depth>
+static void ssim_dsp_init(SSIMDSPContext<depth> *dsp)
+{
+    dsp->ssim_4x4x2_core = ssim_4x4x2_core_c<depth>;
+    dsp->ssim_end4       = ssim_end4_c<depth>;
+    dsp->ssim_end_fast   = NULL;
+    ssim_dsp_init_arch(dsp);
+}
+
+// 每个位深一个，第一次使用时初始化
+template <int depth>
+static const SSIMDSPContext<depth> &ssim_dsp()
+{
+    static SSIMDSPContext<depth> dsp;
+    static std::once_flag once;
+    std::call_once(once, [] { ssim_dsp_init(&dsp); });
+    return dsp;
+}
+
+/*
+ * 4x4块的ss - 2*s12正好是块内差值的平方和，所以psnr需要的sse可以顺便从块的和里得到。
+ * 块没有覆盖到的右边和下边不足4个像素的部分由plane_sse_edge()补上。
+ */
+template <typename sum_t>
+static uint64_t block_row_sse(const sum_t (*sums)[4], int width)
+{
+    uint64_t sse = 0;
+    for (int x = 0; x < width; x++)
+        sse += sums[x][2] - 2 * sums[x][3];
+    return sse;
+}
+
+template <typename pixel>
+static uint64_t pixel_sse(const pixel *pix1, intptr_t stride1,
+                          const pixel *pix2, intptr_t stride2,
+                          int x0, int x1, int y0, int y1)
+{
+    uint64_t sse = 0;
+    for (int y = y0; y < y1; y++)
+    {
+        for (int x = x0; x < x1; x++)
+        {
+            int64_t d = (int64_t)pix1[y * stride1 + x] - pix2[y * stride2 + x];
+            sse += d * d;
+        }
+    }
+    return sse;
+}
+
+template <typename pixel>
+static uint64_t plane_sse_edge(const pixel *pix1, intptr_t stride1,
+                               const pixel *pix2, intptr_t stride2,
+                               int width, int height)
+{
+    int w4 = width & ~3;
+    int h4 = height & ~3;
+    return pixel_sse(pix1, stride1, pix2, stride2, w4, width, 0, h4) +
+           pixel_sse(pix1, stride1, pix2, stride2, 0, width, h4, height);
+}
+
+// sse不为NULL时顺便输出整个平面的差值平方和，fast_end时用dsp.ssim_end_fast(如果有)
+template <int depth, typename pixel = typename PixelTraits<depth>::pixel>
+ssim_value ssim_plane(
+    const pixel *pix1, intptr_t stride1,
+    const pixel *pix2, intptr_t stride2,
+    int width, int height, void *buf, int *cnt, uint64_t *sse = NULL, int fast_end = 0)
+{
+    typedef typename PixelTraits<depth>::sum_t sum_t;
+    const SSIMDSPContext<depth> &dsp = ssim_dsp<depth>();
+    int z = 0;
+    int x, y;
+    ssim_value ssim;
+    ssim.L = 0.0;
+    ssim.C_S = 0.0;
+    ssim.S = 0.0;
+
+    sum_t(*sum0)[4] = (sum_t(*)[4])buf; 
+    sum_t(*sum1)[4] = sum0 + (width >> 2) + 3;
+    if (sse)
+        *sse = plane_sse_edge(pix1, stride1, pix2, stride2, width, height);
+    width >>= 2;
+    height >>= 2; 
+    for (y = 1; y < height; y++)
+    {
+        for (; z <= y; z++)
+        {
+            // FFSWAP( (sum_t (*)[4]), sum0, sum1 );
+            sum_t(*tmp)[4] = sum0;
+            sum0 = sum1;
+            sum1 = tmp;
+
+            for (x = 0; x < width; x += 2)
+                dsp.ssim_4x4x2_core(&pix1[4 * (x + z * stride1)], stride1, &pix2[4 * (x + z * stride2)], stride2, &sum0[x]);
+            if (sse)
+                *sse += block_row_sse(sum0, width);
+        }
+
+        if (fast_end && dsp.ssim_end_fast)
+        {
+            ssim_value tmp = dsp.ssim_end_fast(sum0, sum1, width - 1);
+            ssim.L   += tmp.L;
+            ssim.C_S += tmp.C_S;
+            ssim.S   += tmp.S;
+            continue;
+        }
+
+        for (x = 0; x < width - 1; x += 4)
+        {
+            ssim_value tmp;
+            tmp = dsp.ssim_end4(sum0 + x, sum1 + x, FFMIN(4, width - x - 1));
+            ssim.L   += tmp.L;
+            ssim.C_S += tmp.C_S;
+            ssim.S   += tmp.S;
+        }
+    }
+
+    ssim.L /= (height - 1) * (width - 1);
+    ssim.C_S /= (height - 1) * (width - 1);
+    ssim.S /= (height - 1) * (width - 1);
+    return ssim;
+}
+
+/****************************************************************************
+ * gaussian window (--window gaussian)
+ ****************************************************************************/
+/*
+ * 论文中的11x11、sigma=1.5的高斯窗口。二维窗口是一维窗口的外积，所以先竖直后水平
+ * 做两次一维卷积，每个像素每个统计量只要22次乘加而不是121次。按GAUSS_TILE列分块，
+ * 块内从上到下逐行滑动，11行输入和中间结果都留在L1/L2里。
+ * 只统计窗口完全落在图像内的位置(相当于MATLAB里filter2的'valid')，下采样用浮点的2x2均值。
+ * x86上竖直和水平滤波有AVX2版本，运算顺序与C版本相同且不用FMA，结果逐位一致。
+ */
+#define GAUSS_TAPS 11
+#define GAUSS_TILE 256 // 每次处理的输出列数
+#define GAUSS_ROWS_SIZE (5 * (GAUSS_TILE + GAUSS_TAPS - 1) + 5 * GAUSS_TILE) // 中间结果需要的float个数
+
+static const float *gauss_window()
+{
+    static float g[GAUSS_TAPS];
+    static std::once_flag once;
+    std::call_once(once, [] {
+        double w[GAUSS_TAPS], sum = 0;
+        for (int i = 0; i < GAUSS_TAPS; i++)
+        {
+            double d = i - GAUSS_TAPS / 2;
+            w[i] = exp(-d * d / (2 * 1.5 * 1.5));
+            sum += w[i];
+        }
+        for (int i = 0; i < GAUSS_TAPS; i++)
+            g[i] = (float)(w[i] / sum);
+    });
+    return g;
+}
+
+// 竖直方向：out[0..4][x]分别是a、b、a*a、b*b、a*b在11行上的加权和
+template <typename T>
+static void gauss_vfilter_c(const T *pix1, intptr_t stride1, const T *pix2, intptr_t stride2, int width,
+                            const float *g, float *const out[5])
+{
+    for (int x = 0; x < width; x++)
+    {
+        float m1 = 0, m2 = 0, s11 = 0, s22 = 0, s12 = 0;
+        for (int k = 0; k < GAUSS_TAPS; k++)
+        {
+            float a = pix1[x + k * stride1];
+            float b = pix2[x + k * stride2];
+            m1  += g[k] * a;
+            m2  += g[k] * b;
+            s11 += g[k] * (a * a);
+            s22 += g[k] * (b * b);
+            s12 += g[k] * (a * b);
+        }
+        out[0][x] = m1;
+        out[1][x] = m2;
+        out[2][x] = s11;
+        out[3][x] = s22;
+        out[4][x] = s12;
+    }
+}
+
+// 水平方向：in的每一行有width+10个数，输出width个
+static void gauss_hfilter_c(const float *const in[5], int width, const float *g, float *const out[5])
+{
+    for (int i = 0; i < 5; i++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            float sum = 0;
+            for (int k = 0; k < GAUSS_TAPS; k++)
+                sum += g[k] * in[i][x + k];
+            out[i][x] = sum;
+        }
+    }
+}
+
+#if ARCH_X86
+__attribute__((target("avx2")))
+static inline __m256 gauss_load8(const uint8_t *p)
+{
+    return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)p)));
+}
+
+__attribute__((target("avx2")))
+static inline __m256 gauss_load8(const uint16_t *p)
+{
+    return _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)p)));
+}
+
+__attribute__((target("avx2")))
+static inline __m256 gauss_load8(const float *p)
+{
+    return _mm256_loadu_ps(p);
+}
+
+template <typename T>
+__attribute__((target("avx2")))
+static void gauss_vfilter_avx2(const T *pix1, intptr_t stride1, const T *pix2, intptr_t stride2, int width,
+                               const float *g, float *const out[5])
+{
+    int x = 0;
+    for (; x + 8 <= width; x += 8)
+    {
+        __m256 m1 = _mm256_setzero_ps(), m2 = _mm256_setzero_ps();
+        __m256 s11 = _mm256_setzero_ps(), s22 = _mm256_setzero_ps(), s12 = _mm256_setzero_ps();
+        for (int k = 0; k < GAUSS_TAPS; k++)
+        {
+            __m256 gk = _mm256_set1_ps(g[k]);
+            __m256 a = gauss_load8(pix1 + x + k * stride1);
+            __m256 b = gauss_load8(pix2 + x + k * stride2);
+            m1  = _mm256_add_ps(m1, _mm256_mul_ps(gk, a));
+            m2  = _mm256_add_ps(m2, _mm256_mul_ps(gk, b));
+            s11 = _mm256_add_ps(s11, _mm256_mul_ps(gk, _mm256_mul_ps(a, a)));
+            s22 = _mm256_add_ps(s22, _mm256_mul_ps(gk, _mm256_mul_ps(b, b)));
+            s12 = _mm256_add_ps(s12, _mm256_mul_ps(gk, _mm256_mul_ps(a, b)));
+        }
+        _mm256_storeu_ps(out[0] + x, m1);
+        _mm256_storeu_ps(out[1] + x, m2);
+        _mm256_storeu_ps(out[2] + x, s11);
+        _mm256_storeu_ps(out[3] + x, s22);
+        _mm256_storeu_ps(out[4] + x, s12);
+    }
+
+    if (x < width)
+    {
+        float *tail[5] = {out[0] + x, out[1] + x, out[2] + x, out[3] + x, out[4] + x};
+        gauss_vfilter_c(pix1 + x, stride1, pix2 + x, stride2, width - x, g, tail);
+    }
+}
+
+__attribute__((target("avx2")))
+static void gauss_hfilter_avx2(const float *const in[5], int width, const float *g, float *const out[5])
+{
+    for (int i = 0; i < 5; i++)
+    {
+        int x = 0;
+        for (; x + 8 <= width; x += 8)
+        {
+            __m256 sum = _mm256_setzero_ps();
+            for (int k = 0; k < GAUSS_TAPS; k++)
+                sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(g[k]), _mm256_loadu_ps(in[i] + x + k)));
+            _mm256_storeu_ps(out[i] + x, sum);
+        }
+        for (; x < width; x++)
+        {
+            float sum = 0;
+            for (int k = 0; k < GAUSS_TAPS; k++)
+                sum += g[k] * in[i][x + k];
+            out[i][x] = sum;
+        }
+    }
+}
+#endif
+
+template <typename T>
+struct GaussDSPContext
+{
+    void (*vfilter)(const T *pix1, intptr_t stride1, const T *pix2, intptr_t stride2, int width,
+                    const float *g, float *const out[5]);
+    void (*hfilter)(const float *const in[5], int width, const float *g, float *const out[5]);
+};
+
+template <typename T>
+static const GaussDSPContext<T> &gauss_dsp()
+{
+    static GaussDSPContext<T> dsp;
+    static std::once_flag once;
+    std::call_once(once, [] {
+        dsp.vfilter = gauss_vfilter_c<T>;
+        dsp.hfilter = gauss_hfilter_c;
+#if ARCH_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+        {
+            dsp.vfilter = gauss_vfilter_avx2<T>;
+            dsp.hfilter = gauss_hfilter_avx2;
+        }
+#endif
+    });
+    return dsp;
+}
+
+// 由滤波后的均值和二阶矩计算一行的L和C_S，累加到double里
+static void gauss_ssim_row(const float *const m[5], int width, float c1, float c2,
+                           double *l_sum, double *cs_sum, double *s_sum)
+{
+    double l = 0, cs = 0, ss = 0;
+    for (int x = 0; x < width; x++)
+    {
+        float mu1 = m[0][x], mu2 = m[1][x];
+        float var1  = m[2][x] - mu1 * mu1;
+        float var2  = m[3][x] - mu2 * mu2;
+        float covar = m[4][x] - mu1 * mu2;
+        float lv  = (2 * mu1 * mu2 + c1) / (mu1 * mu1 + mu2 * mu2 + c1);
+        float csv = (2 * covar + c2) / (var1 + var2 + c2);
+        l  += lv;
+        cs += csv;
+        ss += lv * csv;
+    }
+    *l_sum  += l;
+    *cs_sum += cs;
+    *s_sum  += ss;
+}
+
+// rows至少需要GAUSS_ROWS_SIZE个float
+template <typename T>
+static ssim_value gauss_ssim_plane(const T *pix1, intptr_t stride1, const T *pix2, intptr_t stride2,
+                                   int width, int height, int pixel_max, float *rows)
+{
+    const GaussDSPContext<T> &dsp = gauss_dsp<T>();
+    const float *g = gauss_window();
+    const float c1 = (.01 * pixel_max) * (.01 * pixel_max);
+    const float c2 = (.03 * pixel_max) * (.03 * pixel_max);
+    int ow = width - (GAUSS_TAPS - 1);
+    int oh = height - (GAUSS_TAPS - 1);
+    double l_sum = 0, cs_sum = 0, s_sum = 0;
+    ssim_value value;
+
+    float *v[5], *m[5];
+    for (int i = 0; i < 5; i++)
+    {
+        v[i] = rows + i * (GAUSS_TILE + GAUSS_TAPS - 1);
+        m[i] = rows + 5 * (GAUSS_TILE + GAUSS_TAPS - 1) + i * GAUSS_TILE;
+    }
+
+    for (int x0 = 0; x0 < ow; x0 += GAUSS_TILE)
+    {
+        int tw = FFMIN(GAUSS_TILE, ow - x0);
+        for (int y = 0; y < oh; y++)
+        {
+            dsp.vfilter(pix1 + y * stride1 + x0, stride1, pix2 + y * stride2 + x0, stride2, tw + GAUSS_TAPS - 1, g, v);
+            dsp.hfilter(v, tw, g, m);
+            gauss_ssim_row(m, tw, c1, c2, &l_sum, &cs_sum, &s_sum);
+        }
+    }
+
+    value.L   = l_sum / ((double)ow * oh);
+    value.C_S = cs_sum / ((double)ow * oh);
+    value.S   = s_sum / ((double)ow * oh);
+    return value;
+}
+
+template <typename T>
+static void downsample_2x2_mean_float(const T *input, intptr_t stride, int width, int height, float *output)
+{
+    int downsample_width =  width >> 1;
+    int downsample_height = height >> 1;
+
+    for (int y = 0; y < downsample_height; y++)
+    {
+        const T *in0 = input + 2 * y * stride;
+        const T *in1 = in0 + stride;
+        for (int x = 0; x < downsample_width; x++)
+            output[y * downsample_width + x] = ((float)in0[2 * x] + in0[2 * x + 1] + in1[2 * x] + in1[2 * x + 1]) * 0.25f;
+    }
+}
+
+template <typename pixel>
+static void downsample_2x2_mean(const pixel *input, intptr_t stride, int width, int height, pixel *output) 
+{
+    int downsample_width =  width >> 1;
+    int downsample_height = height >> 1;
+
+    for (int y = 0; y < downsample_height; y++) 
+    {
+        for (int x =0; x < downsample_width; x++) 
+        {
+            output[y * downsample_width + x] = (input[2 * y * stride + 2 * x] +
+                                                input[2 * y * stride + 2 * x + 1] +
+                                                input[(2 * y + 1) * stride + 2 * x] +
+                                                input[(2 * y + 1) * stride + 2 * x + 1]) / 4;
+        }
+    }
+}
+
+/*
+ * 帧内按行分带并行用的线程池，线程常驻，避免每个平面、每个尺度都创建线程。
+ * band_pool_run()把nb_bands个带分给工作线程，调用者自己也参与计算(thread为0)，
+ * 返回时所有的带都已经完成。
+ */
+typedef struct
+{
+    std::mutex              mutex;
+    std::condition_variable start_cond;
+    std::condition_variable done_cond;
+    std::vector<std::thread> threads;
+    void   (*fn)(void *arg, int band, int thread);
+    void    *arg;
+    int      nb_bands;
+    int      next;     // 下一个待处理的带
+    int      finished; // 已经完成的带
+    unsigned gen;      // 每调用一次band_pool_run加一
+    int      quit;
+} BandPool;
+
+static void band_pool_work(BandPool *pool, std::unique_lock<std::mutex> &lock, int thread)
+{
+    while (pool->next < pool->nb_bands)
+    {
+        int band = pool->next++;
+        lock.unlock();
+        pool->fn(pool->arg, band, thread);
+        lock.lock();
+        if (++pool->finished == pool->nb_bands)
+            pool->done_cond.notify_all();
+    }
+}
+
+static void band_worker(BandPool *pool, int thread)
+{
+    unsigned gen = 0;
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    for (;;)
+    {
+        pool->start_cond.wait(lock, [&] { return pool->gen != gen || pool->quit; });
+        if (pool->quit)
+            break;
+        gen = pool->gen;
+        band_pool_work(pool, lock, thread);
+    }
+}
+
+static BandPool *band_pool_create(int nb_threads)
+{
+    BandPool *pool = new BandPool();
+    for (int i = 1; i < nb_threads; i++)
+        pool->threads.emplace_back(band_worker, pool, i);
+    return pool;
+}
+
+static void band_pool_destroy(BandPool *pool)
+{
+    if (!pool)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        pool->quit = 1;
+    }
+    pool->start_cond.notify_all();
+    for (auto &thread : pool->threads)
+        thread.join();
+    delete pool;
+}
+
+static void band_pool_run(BandPool *pool, int nb_bands, void (*fn)(void *arg, int band, int thread), void *arg)
+{
+    if (nb_bands <= 1)
+    {
+        fn(arg, 0, 0);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    pool->fn       = fn;
+    pool->arg      = arg;
+    pool->nb_bands = nb_bands;
+    pool->next     = 0;
+    pool->finished = 0;
+    pool->gen++;
+    pool->start_cond.notify_all();
+    band_pool_work(pool, lock, 0);
+    pool->done_cond.wait(lock, [pool] { return pool->finished == pool->nb_bands; });
+}
+
+#define MAX_SCALE 5
+#define PIXEL_PADDING 32 // ssim_4x4x2_core在宽度不是8的倍数时会越过行尾最多读8个像素
+
+/*
+ * 计算MS-SSIM需要的所有缓存，在ms_ssim_init()时按最大的平面(亮度)一次性分配，
+ * 之后每一帧、每一个平面都复用，稳态下每帧不再有任何malloc/memset。
+ * pyramid[i][0]不分配，直接指向输入的平面；pyramid[i][k]是第k次2x2下采样的结果。
+ */
+enum
+{
+    WINDOW_BLOCK,    // 重叠的8x8块求和
+    WINDOW_GAUSSIAN, // 11x11高斯窗口
+};
+
+/*
+ * 各阶段的耗时：ctx->stats不为NULL时每层的ssim、每次下采样和参考金字塔都计时并计数，
+ * 为NULL(默认)时只多一次判断。分带时计的是整个band_pool_run的墙上时间，
+ * 分块时是各批的和，每个平面每层计一次。
+ */
+enum
+{
+    STAGE_SSIM       = 0,                            // 第k层(0起)的ssim是STAGE_SSIM + k
+    STAGE_DOWNSAMPLE = STAGE_SSIM + MAX_SCALE,       // 下采样出第k层是STAGE_DOWNSAMPLE + k，k >= 1
+    STAGE_BUILD_REF  = STAGE_DOWNSAMPLE + MAX_SCALE, // ms_ssim_build_ref
+    NB_CORE_STAGES,
+};
+
+typedef struct
+{
+    int64_t  ns[NB_CORE_STAGES];
+    uint32_t count[NB_CORE_STAGES];
+} MSSSIMStats;
+
+static inline int64_t stats_clock()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static inline void stats_add(MSSSIMStats *stats, int stage, int64_t start)
+{
+    stats->ns[stage] += stats_clock() - start;
+    stats->count[stage]++;
+}
+
+typedef struct
+{
+    int      width;
+    int      height;
+    int      bit_depth;
+    int      window;
+    int      pixel_size;            // 每个像素的字节数
+    int      sum_size;              // 4x4块的和每个分量的字节数
+    void    *temp;                  // ssim_plane使用的sum0/sum1
+    uint8_t *pyramid[2][MAX_SCALE]; // 按bit_depth对应的像素类型访问
+
+    // 一个参考对多个失真时参考帧Y/U/V各自的金字塔，每帧只建一次，只在ref_cache时分配
+    int      ref_cache;
+    uint8_t *ref_pyramid[3][MAX_SCALE];
+
+    // 以下只在band_threads > 1时使用
+    int         band_threads;
+    BandPool   *band_pool;
+    uint8_t    *band_temp;          // 每个线程一份sum0/sum1
+    ssim_value *band_ssim;          // 每次ssim_end4的结果，按行的顺序归约
+    uint64_t   *band_sse;           // 每个带的sse
+
+    // 以下只在window为WINDOW_GAUSSIAN时使用
+    float   *gauss_pyramid[2][MAX_SCALE]; // 1~4层的浮点金字塔
+    float   *gauss_rows;                  // 滤波的中间结果
+
+    // 以下只在tiled时使用，此时不分配pyramid
+    int      tiled;
+    uint8_t *tile_ring[2][MAX_SCALE];     // 1~4层的环形行缓存
+    void    *tile_temp[MAX_SCALE];        // 每层自己的sum0/sum1
+
+    int      fast_end;                    // 块窗口用dsp.ssim_end_fast，不逐位一致
+    MSSSIMStats *stats;                   // 不为NULL时累计各阶段的耗时，由调用者设置
+} MSSSIMContext;
+
+#define SSIM_TEMP_SIZE(width) (8 * (((width) >> 2) + 3)) // sum0和sum1各(width/4+3)个sum_t[4]
+#define TILE_ROWS 16                 // 分块模式每次从输入取的行数，必须是4的倍数
+#define TILE_RING (TILE_ROWS + 8)    // 下一层每次最多新增TILE_ROWS/2+1行，未消费的最多3行
+
+static void ms_ssim_uninit(MSSSIMContext *ctx)
+{
+    band_pool_destroy(ctx->band_pool);
+    ctx->band_pool = NULL;
+    free(ctx->band_temp);
+    free(ctx->band_ssim);
+    free(ctx->band_sse);
+    ctx->band_temp = NULL;
+    ctx->band_ssim = NULL;
+    ctx->band_sse  = NULL;
+    free(ctx->temp);
+    ctx->temp = NULL;
+    free(ctx->gauss_rows);
+    ctx->gauss_rows = NULL;
+    for (int i = 0; i < 2; i++)
+    {
+        for (int k = 1; k < MAX_SCALE; k++)
+        {
+            free(ctx->pyramid[i][k]);
+            free(ctx->gauss_pyramid[i][k]);
+            free(ctx->tile_ring[i][k]);
+            ctx->pyramid[i][k] = NULL;
+            ctx->gauss_pyramid[i][k] = NULL;
+            ctx->tile_ring[i][k] = NULL;
+        }
+    }
+    for (int k = 0; k < MAX_SCALE; k++)
+    {
+        free(ctx->tile_temp[k]);
+        ctx->tile_temp[k] = NULL;
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        for (int k = 1; k < MAX_SCALE; k++)
+        {
+            free(ctx->ref_pyramid[i][k]);
+            ctx->ref_pyramid[i][k] = NULL;
+        }
+    }
+}
+
+static int ms_ssim_init(MSSSIMContext *ctx, int width, int height, int bit_depth,
+                        int window = WINDOW_BLOCK, int band_threads = 1, int ref_cache = 0, int tiled = 0, int fast_end = 0)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->width      = width;
+    ctx->height     = height;
+    ctx->bit_depth  = bit_depth;
+    ctx->window     = window;
+    ctx->fast_end   = fast_end;
+    ctx->pixel_size = bit_depth > 8 ? 2 : 1;
+    ctx->sum_size   = bit_depth > 12 ? sizeof(int64_t) : sizeof(int);
+
+    ctx->temp = calloc(SSIM_TEMP_SIZE(width), ctx->sum_size);
+    if (!ctx->temp)
+        return -1;
+
+    if (band_threads > 1)
+    {
+        ctx->band_threads = band_threads;
+        ctx->band_temp = (uint8_t *)calloc((size_t)band_threads * SSIM_TEMP_SIZE(width), ctx->sum_size);
+        ctx->band_ssim = (ssim_value *)malloc((size_t)(height >> 2) * (((width >> 2) + 2) >> 2) * sizeof(*ctx->band_ssim));
+        ctx->band_sse  = (uint64_t *)malloc(2 * band_threads * sizeof(*ctx->band_sse)); // band_count()最多2*band_threads个带
+        if (!ctx->band_temp || !ctx->band_ssim || !ctx->band_sse)
+        {
+            ms_ssim_uninit(ctx);
+            return -1;
+        }
+        ctx->band_pool = band_pool_create(band_threads);
+    }
+
+    // 分块模式只需要每层TILE_RING行，只支持块窗口、不分带
+    if (tiled && window == WINDOW_BLOCK && band_threads <= 1)
+    {
+        ctx->tiled = 1;
+        for (int k = 0; k < MAX_SCALE; k++)
+        {
+            ctx->tile_temp[k] = calloc(SSIM_TEMP_SIZE(width >> k), ctx->sum_size);
+            if (!ctx->tile_temp[k])
+            {
+                ms_ssim_uninit(ctx);
+                return -1;
+            }
+        }
+    }
+
+    for (int i = 0; i < 2; i++)
+    {
+        for (int k = 1; k < MAX_SCALE; k++)
+        {
+            uint8_t **buf = ctx->tiled ? &ctx->tile_ring[i][k] : &ctx->pyramid[i][k];
+            size_t size = (size_t)(width >> k) * (ctx->tiled ? TILE_RING : height >> k) + PIXEL_PADDING;
+            *buf = (uint8_t *)calloc(size, ctx->pixel_size);
+            if (!*buf)
+            {
+                ms_ssim_uninit(ctx);
+                return -1;
+            }
+        }
+    }
+
+    // 高斯窗口的金字塔是浮点的，不缓存参考
+    if (ref_cache && window == WINDOW_BLOCK)
+    {
+        ctx->ref_cache = 1;
+        for (int i = 0; i < 3; i++)
+        {
+            for (int k = 1; k < MAX_SCALE; k++)
+            {
+                size_t size = (size_t)((width >> !!i) >> k) * ((height >> !!i) >> k) + PIXEL_PADDING;
+                ctx->ref_pyramid[i][k] = (uint8_t *)calloc(size, ctx->pixel_size);
+                if (!ctx->ref_pyramid[i][k])
+                {
+                    ms_ssim_uninit(ctx);
+                    return -1;
+                }
+            }
+        }
+    }
+
+    if (window == WINDOW_GAUSSIAN)
+    {
+        ctx->gauss_rows = (float *)malloc(GAUSS_ROWS_SIZE * sizeof(float));
+        if (!ctx->gauss_rows)
+        {
+            ms_ssim_uninit(ctx);
+            return -1;
+        }
+        for (int i = 0; i < 2; i++)
+        {
+            for (int k = 1; k < MAX_SCALE; k++)
+            {
+                ctx->gauss_pyramid[i][k] = (float *)malloc((size_t)(width >> k) * (height >> k) * sizeof(float));
+                if (!ctx->gauss_pyramid[i][k])
+                {
+                    ms_ssim_uninit(ctx);
+                    return -1;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * 分带计算时每个带从自己的第一行的上一行块开始算，也就是带与带之间重叠一行4x4块，
+ * 这正是ssim_plane里sum0/sum1滚动需要的。每次ssim_end4的结果不直接累加，
+ * 而是存到band_ssim里，最后由调用者按行的顺序累加，所以结果与单线程的ssim_plane
+ * 逐位一致，与线程数和分带方式都无关。
+ */
+typedef struct
+{
+    MSSSIMContext *ctx;
+    const uint8_t *pix1;
+    const uint8_t *pix2;
+    uint8_t  *out1;    // 下采样的输出
+    uint8_t  *out2;
+    intptr_t stride1;
+    intptr_t stride2;
+    int      width;
+    int      height;
+    int      nb_bands;
+    uint64_t *sse;     // 不为NULL时每个带输出自己的sse
+} BandJob;
+
+#define MIN_BAND_ROWS 4 // 每个带至少这么多行(ssim以4x4块为单位，下采样以输出像素为单位)
+
+static int band_count(MSSSIMContext *ctx, int rows)
+{
+    return FFMAX(1, FFMIN(2 * ctx->band_threads, rows / MIN_BAND_ROWS));
+}
+
+template <int depth>
+static void ssim_band(void *arg, int band, int thread)
+{
+    typedef typename PixelTraits<depth>::pixel pixel;
+    typedef typename PixelTraits<depth>::sum_t sum_t;
+    const SSIMDSPContext<depth> &dsp = ssim_dsp<depth>();
+    BandJob *job = (BandJob *)arg;
+    MSSSIMContext *ctx = job->ctx;
+    const pixel *pix1 = (const pixel *)job->pix1;
+    const pixel *pix2 = (const pixel *)job->pix2;
+    int width  = job->width >> 2;
+    int height = job->height >> 2;
+    int groups = (width + 2) >> 2;
+    int y0 = 1 + (height - 1) * band / job->nb_bands;
+    int y1 = 1 + (height - 1) * (band + 1) / job->nb_bands;
+    sum_t(*sum0)[4] = (sum_t(*)[4])(ctx->band_temp + (size_t)thread * SSIM_TEMP_SIZE(ctx->width) * sizeof(sum_t));
+    sum_t(*sum1)[4] = sum0 + width + 3;
+    int z = y0 - 1;
+    uint64_t sse = 0;
+
+    for (int y = y0; y < y1; y++)
+    {
+        for (; z <= y; z++)
+        {
+            sum_t(*tmp)[4] = sum0;
+            sum0 = sum1;
+            sum1 = tmp;
+
+            for (int x = 0; x < width; x += 2)
+                dsp.ssim_4x4x2_core(&pix1[4 * (x + z * job->stride1)], job->stride1,
+                                    &pix2[4 * (x + z * job->stride2)], job->stride2, &sum0[x]);
+            // 重叠的那一行已经由上一个带算过了
+            if (job->sse && (z >= y0 || band == 0))
+                sse += block_row_sse(sum0, width);
+        }
+
+        ssim_value *out = ctx->band_ssim + (y - 1) * groups;
+        if (ctx->fast_end && dsp.ssim_end_fast)
+        {
+            // 一行只有一个结果，这一行其余的位置填0，按行归约的结果不受影响
+            out[0] = dsp.ssim_end_fast(sum0, sum1, width - 1);
+            memset(out + 1, 0, (groups - 1) * sizeof(*out));
+            continue;
+        }
+        for (int x = 0; x < width - 1; x += 4)
+            *out++ = dsp.ssim_end4(sum0 + x, sum1 + x, FFMIN(4, width - x - 1));
+    }
+
+    if (job->sse)
+        job->sse[band] = sse;
+}
+
+template <int depth>
+static ssim_value ssim_plane_bands(MSSSIMContext *ctx,
+                                   const uint8_t *pix1, intptr_t stride1,
+                                   const uint8_t *pix2, intptr_t stride2,
+                                   int width, int height, uint64_t *sse = NULL)
+{
+    typedef typename PixelTraits<depth>::pixel pixel;
+    ssim_value ssim;
+    ssim.L = 0.0;
+    ssim.C_S = 0.0;
+    ssim.S = 0.0;
+
+    BandJob job = {ctx, pix1, pix2, NULL, NULL, stride1, stride2, width, height, 0, sse ? ctx->band_sse : NULL};
+    job.nb_bands = band_count(ctx, (height >> 2) - 1);
+    band_pool_run(ctx->band_pool, job.nb_bands, ssim_band<depth>, &job);
+
+    if (sse)
+    {
+        *sse = plane_sse_edge((const pixel *)pix1, stride1, (const pixel *)pix2, stride2, width, height);
+        for (int i = 0; i < job.nb_bands; i++)
+            *sse += ctx->band_sse[i];
+    }
+
+    width >>= 2;
+    height >>= 2;
+    int groups = (width + 2) >> 2;
+    for (int i = 0; i < (height - 1) * groups; i++)
+    {
+        ssim.L   += ctx->band_ssim[i].L;
+        ssim.C_S += ctx->band_ssim[i].C_S;
+        ssim.S   += ctx->band_ssim[i].S;
+    }
+
+    ssim.L /= (height - 1) * (width - 1);
+    ssim.C_S /= (height - 1) * (width - 1);
+    ssim.S /= (height - 1) * (width - 1);
+    return ssim;
+}
+
+template <int depth>
+static void downsample_band(void *arg, int band, int thread)
+{
+    typedef typename PixelTraits<depth>::pixel pixel;
+    BandJob *job = (BandJob *)arg;
+    const pixel *pix1 = (const pixel *)job->pix1;
+    const pixel *pix2 = (const pixel *)job->pix2;
+    int rows = job->height >> 1;
+    int y0 = rows * band / job->nb_bands;
+    int y1 = rows * (band + 1) / job->nb_bands;
+    int ow = job->width >> 1;
+
+    // 参考的金字塔已经缓存时out1为NULL
+    if (job->out1)
+        downsample_2x2_mean(pix1 + 2 * y0 * job->stride1, job->stride1, job->width, 2 * (y1 - y0), (pixel *)job->out1 + y0 * ow);
+    if (job->out2)
+        downsample_2x2_mean(pix2 + 2 * y0 * job->stride2, job->stride2, job->width, 2 * (y1 - y0), (pixel *)job->out2 + y0 * ow);
+}
+
+/*
+ * 高斯窗口模式：第1层直接对输入的像素滤波，之后每层都是浮点的2x2均值下采样，
+ * 各尺度L和C_S的组合方式与块模式完全相同，两种模式只有窗口不一样。
+ */
+template <int depth>
+static float ms_ssim_plane_gauss(MSSSIMContext *ctx, const uint8_t *pix1, intptr_t stride1, const uint8_t *pix2, intptr_t stride2,
+                                 int width, int height, int scale, PlaneMetrics *metrics)
+{
+    typedef typename PixelTraits<depth>::pixel pixel;
+    ssim_value value;
+    float result = 1.0;
+    float luminance_value[MAX_SCALE];
+    int w = width;
+    int h = height;
+    float **img1 = ctx->gauss_pyramid[0];
+    float **img2 = ctx->gauss_pyramid[1];
+
+    if (scale < 1 || scale > MAX_SCALE)
+    {
+        scale = MAX_SCALE;
+    }
+
+    for (int i = 1; i <= scale; i++)
+    {
+        int64_t t = ctx->stats ? stats_clock() : 0;
+        if (i == 1)
+        {
+            value = gauss_ssim_plane((const pixel *)pix1, stride1, (const pixel *)pix2, stride2, w, h,
+                                     PixelTraits<depth>::pixel_max, ctx->gauss_rows);
+            if (metrics)
+            {
+                // 高斯窗口没有块的和可用，sse只能直接算
+                metrics->sse  = pixel_sse((const pixel *)pix1, stride1, (const pixel *)pix2, stride2, 0, w, 0, h);
+                metrics->ssim = value.S;
+            }
+        }
+        else
+        {
+            if (i == 2)
+            {
+                downsample_2x2_mean_float((const pixel *)pix1, stride1, w, h, img1[1]);
+                downsample_2x2_mean_float((const pixel *)pix2, stride2, w, h, img2[1]);
+            }
+            else
+            {
+                downsample_2x2_mean_float(img1[i-2], w, w, h, img1[i-1]);
+                downsample_2x2_mean_float(img2[i-2], w, w, h, img2[i-1]);
+            }
+            if (ctx->stats)
+            {
+                stats_add(ctx->stats, STAGE_DOWNSAMPLE + i - 1, t);
+                t = stats_clock();
+            }
+
+            w = w >> 1;
+            h = h >> 1;
+            value = gauss_ssim_plane(img1[i-1], w, img2[i-1], w, w, h, PixelTraits<depth>::pixel_max, ctx->gauss_rows);
+        }
+        if (ctx->stats)
+            stats_add(ctx->stats, STAGE_SSIM + i - 1, t);
+
+        result *= pow(value.C_S, WEIGHT[i-1]);
+        luminance_value[i-1] = value.L;
+    }
+
+    result *= pow(luminance_value[scale-1], WEIGHT[scale-1]);
+    return result;
+}
+
+/*
+ * 分块模式(--tiled)：逐层分开算时，每一层都要把上一层整幅读两遍(算ssim、下采样)
+ * 再写一遍下采样的结果，8K的平面远大于L2，每一遍都要走内存。分块模式每次从输入
+ * 取TILE_ROWS行，能算的4x4块行马上算ssim，能下采样的行马上写进下一层的环形缓存，
+ * 再接着处理下一层，整个金字塔在同一批还在cache里的数据上往下推，输入只从内存读一遍。
+ * 每层的ssim_end4按行的顺序累加，下采样与downsample_2x2_mean相同，结果与逐层计算逐位一致。
+ */
+typedef struct
+{
+    const uint8_t *pix[2];   // 第0层是输入，之后是环形缓存(或者缓存的参考金字塔)
+    intptr_t stride[2];
+    int      ring[2];        // 环形缓存的行数，0表示整幅图像都在
+    int      width;
+    int      height;
+    int      avail;          // 已经有的行数
+    int      z;              // 已经算过的4x4块行数
+    int      y;              // 已经下采样给下一层的行数
+    void    *sum0;
+    void    *sum1;
+    ssim_value ssim;
+    uint64_t sse;
+} TileLevel;
+
+template <typename pixel>
+static inline const pixel *tile_row(const TileLevel *l, int i, int y)
+{
+    return (const pixel *)l->pix[i] + (l->ring[i] ? y % l->ring[i] : y) * l->stride[i];
+}
+
+template <int depth>
+static void tile_ssim(TileLevel *l, int with_sse, int fast_end)
+{
+    typedef typename PixelTraits<depth>::pixel pixel;
+    typedef typename PixelTraits<depth>::sum_t sum_t;
+    const SSIMDSPContext<depth> &dsp = ssim_dsp<depth>();
+    int width  = l->width >> 2;
+    int height = l->height >> 2;
+
+    // 与ssim_plane一致，不到两行块时什么都不算
+    if (height < 2)
+        return;
+
+    // 环形缓存的行数是4的倍数，一行块的4行总是连续的
+    for (; l->z < height && 4 * l->z + 4 <= l->avail; l->z++)
+    {
+        sum_t(*sum0)[4] = (sum_t(*)[4])l->sum1;
+        sum_t(*sum1)[4] = (sum_t(*)[4])l->sum0;
+        const pixel *pix1 = tile_row<pixel>(l, 0, 4 * l->z);
+        const pixel *pix2 = tile_row<pixel>(l, 1, 4 * l->z);
+        l->sum0 = sum0;
+        l->sum1 = sum1;
+
+        for (int x = 0; x < width; x += 2)
+            dsp.ssim_4x4x2_core(&pix1[4 * x], l->stride[0], &pix2[4 * x], l->stride[1], &sum0[x]);
+        if (with_sse)
+            l->sse += block_row_sse(sum0, width);
+        if (l->z == 0)
+            continue;
+
+        if (fast_end && dsp.ssim_end_fast)
+        {
+            ssim_value tmp = dsp.ssim_end_fast(sum0, sum1, width - 1);
+            l->ssim.L   += tmp.L;
+            l->ssim.C_S += tmp.C_S;
+            l->ssim.S   += tmp.S;
+            continue;
+        }
+        for (int x = 0; x < width - 1; x += 4)
+        {
+            ssim_value tmp = dsp.ssim_end4(sum0 + x, sum1 + x, FFMIN(4, width - x - 1));
+            l->ssim.L   += tmp.L;
+            l->ssim.C_S += tmp.C_S;
+            l->ssim.S   += tmp.S;
+        }
+    }
+}
+
+template <int depth>
+static void tile_downsample(TileLevel *l, TileLevel *next)
+{
+    typedef typename PixelTraits<depth>::pixel pixel;
+
+    for (; l->y < next->height && 2 * l->y + 2 <= l->avail; l->y++)
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            // 缓存的参考金字塔已经建好了
+            if (next->ring[i])
+                downsample_2x2_mean(tile_row<pixel>(l, i, 2 * l->y), l->stride[i], l->width, 2,
+                                    (pixel *)tile_row<pixel>(next, i, l->y));
+        }
+        next->avail++;
+    }
+}
+
+template <int depth>
+static float ms_ssim_plane_tiled(MSSSIMContext *ctx, const uint8_t *pix1, intptr_t stride1, const uint8_t *pix2, intptr_t stride2,
+                                 int width, int height, int scale, PlaneMetrics *metrics, uint8_t **ref_pyramid)
+{
+    typedef typename PixelTraits<depth>::pixel pixel;
+    TileLevel level[MAX_SCALE];
+    float result = 1.0;
+
+    if (scale < 1 || scale > MAX_SCALE)
+    {
+        scale = MAX_SCALE;
+    }
+
+    memset(level, 0, sizeof(level));
+    for (int k = 0; k < scale; k++)
+    {
+        TileLevel *l = &level[k];
+        l->width  = width >> k;
+        l->height = height >> k;
+        l->sum0   = ctx->tile_temp[k];
+        l->sum1   = (uint8_t *)ctx->tile_temp[k] + ((l->width >> 2) + 3) * 4 * ctx->sum_size;
+        for (int i = 0; i < 2; i++)
+        {
+            if (k == 0)
+            {
+                l->pix[i]    = i ? pix2 : pix1;
+                l->stride[i] = i ? stride2 : stride1;
+            }
+            else if (i == 0 && ref_pyramid)
+            {
+                l->pix[i]    = ref_pyramid[k];
+                l->stride[i] = l->width;
+            }
+            else
+            {
+                l->pix[i]    = ctx->tile_ring[i][k];
+                l->stride[i] = l->width;
+                l->ring[i]   = TILE_RING;
+            }
+        }
+    }
+
+    MSSSIMStats *stats = ctx->stats;
+    while (level[0].avail < height)
+    {
+        level[0].avail = FFMIN(height, level[0].avail + TILE_ROWS);
+        for (int k = 0; k < scale; k++)
+        {
+            int64_t t = stats ? stats_clock() : 0;
+            tile_ssim<depth>(&level[k], k == 0 && metrics, ctx->fast_end);
+            if (stats)
+            {
+                int64_t now = stats_clock();
+                stats->ns[STAGE_SSIM + k] += now - t;
+                t = now;
+            }
+            if (k + 1 < scale)
+            {
+                tile_downsample<depth>(&level[k], &level[k + 1]);
+                if (stats)
+                    stats->ns[STAGE_DOWNSAMPLE + k + 1] += stats_clock() - t;
+            }
+        }
+    }
+    for (int k = 0; stats && k < scale; k++)
+    {
+        stats->count[STAGE_SSIM + k]++;
+        if (k)
+            stats->count[STAGE_DOWNSAMPLE + k]++;
+    }
+
+    for (int k = 0; k < scale; k++)
+    {
+        int w4 = level[k].width >> 2;
+        int h4 = level[k].height >> 2;
+        ssim_value value = level[k].ssim;
+        value.L /= (h4 - 1) * (w4 - 1);
+        value.C_S /= (h4 - 1) * (w4 - 1);
+        value.S /= (h4 - 1) * (w4 - 1);
+        if (k == 0 && metrics)
+        {
+            metrics->sse  = level[0].sse + plane_sse_edge((const pixel *)pix1, stride1, (const pixel *)pix2, stride2, width, height);
+            metrics->ssim = value.S;
+        }
+        result *= pow(value.C_S, WEIGHT[k]);
+        if (k == scale - 1)
+            result *= pow(value.L, WEIGHT[k]);
+    }
+
+    return result;
+}
+
+template <int depth>
+static float ms_ssim_plane_tmpl(MSSSIMContext *ctx, const uint8_t *pix1, intptr_t stride1, const uint8_t *pix2, intptr_t stride2,
+                                int width, int height, int scale, PlaneMetrics *metrics, uint8_t **ref_pyramid)
+{
+    typedef typename PixelTraits<depth>::pixel pixel;
+    ssim_value value;
+    float result = 1.0;
+    float luminance_value[MAX_SCALE];
+    int w = width;
+    int h = height;
+
+    if (ctx->window == WINDOW_GAUSSIAN)
+        return ms_ssim_plane_gauss<depth>(ctx, pix1, stride1, pix2, stride2, width, height, scale, metrics);
+    if (ctx->tiled)
+        return ms_ssim_plane_tiled<depth>(ctx, pix1, stride1, pix2, stride2, width, height, scale, metrics, ref_pyramid);
+
+    // ref_pyramid不为NULL时pix1的各层已经由ms_ssim_build_ref()建好，只需要下采样pix2
+    const uint8_t **img1 = (const uint8_t **)(ref_pyramid ? ref_pyramid : ctx->pyramid[0]);
+    const uint8_t **img2 = (const uint8_t **)ctx->pyramid[1];
+
+    if (scale < 1 || scale > MAX_SCALE) 
+    {
+        scale = MAX_SCALE;
+    }
+
+    img1[0] = pix1;
+    img2[0] = pix2;
+
+    // 计算每个尺度的ssim值.
+    for (int i = 1; i <= scale; i++) 
+    {
+        int64_t t = ctx->stats ? stats_clock() : 0;
+        if (i != 1) 
+        {
+            // 直接下采样到金字塔的下一层，不需要清零也不需要拷贝回来
+            if (ctx->band_pool)
+            {
+                BandJob job = {ctx, img1[i-2], img2[i-2], ref_pyramid ? NULL : ctx->pyramid[0][i-1], ctx->pyramid[1][i-1],
+                               stride1, stride2, w, h, 0, NULL};
+                job.nb_bands = band_count(ctx, h >> 1);
+                band_pool_run(ctx->band_pool, job.nb_bands, downsample_band<depth>, &job);
+            }
+            else
+            {
+                if (!ref_pyramid)
+                    downsample_2x2_mean((const pixel *)img1[i-2], stride1, w, h, (pixel *)img1[i-1]);
+                downsample_2x2_mean((const pixel *)img2[i-2], stride2, w, h, (pixel *)img2[i-1]);
+            }
+
+            w = w >> 1;
+            h = h >> 1;
+            // 只有第0层是输入的跨度，金字塔的各层都是紧凑存放的
+            stride1 = w;
+            stride2 = w;
+            if (ctx->stats)
+            {
+                stats_add(ctx->stats, STAGE_DOWNSAMPLE + i - 1, t);
+                t = stats_clock();
+            }
+        }
+
+        uint64_t *sse = i == 1 && metrics ? &metrics->sse : NULL;
+        if (ctx->band_pool)
+            value = ssim_plane_bands<depth>(ctx, img1[i-1], stride1, img2[i-1], stride2, w, h, sse);
+        else
+            value = ssim_plane<depth>((const pixel *)img1[i-1], stride1, (const pixel *)img2[i-1], stride2, w, h, ctx->temp, NULL, sse, ctx->fast_end);
+        if (ctx->stats)
+            stats_add(ctx->stats, STAGE_SSIM + i - 1, t);
+        if (i == 1 && metrics)
+            metrics->ssim = value.S;
+        result *= pow(value.C_S, WEIGHT[i-1]);
+        luminance_value[i-1] = value.L;
+    }
+
+    result *= pow(luminance_value[scale-1], WEIGHT[scale-1]);
+    return result;
+}
+
+template <int depth>
+static void ms_ssim_build_ref_tmpl(MSSSIMContext *ctx, int plane, const uint8_t *pix, intptr_t stride, int width, int height)
+{
+    typedef typename PixelTraits<depth>::pixel pixel;
+    uint8_t **img = ctx->ref_pyramid[plane];
+
+    img[0] = (uint8_t *)pix;
+    for (int i = 1; i < MAX_SCALE; i++)
+    {
+        if (ctx->band_pool)
+        {
+            BandJob job = {ctx, img[i-1], NULL, img[i], NULL, stride, 0, width, height, 0, NULL};
+            job.nb_bands = band_count(ctx, height >> 1);
+            band_pool_run(ctx->band_pool, job.nb_bands, downsample_band<depth>, &job);
+        }
+        else
+        {
+            downsample_2x2_mean((const pixel *)img[i-1], stride, width, height, (pixel *)img[i]);
+        }
+        width >>= 1;
+        height >>= 1;
+        stride = width;
+    }
+}
+
+/*
+ * 建参考帧第plane个平面的金字塔，之后ms_ssim_plane()传入ctx->ref_pyramid[plane]
+ * 就可以用同一个参考给多个失真打分，参考的下采样每帧只做一次。
+ */
+static inline void ms_ssim_build_ref(MSSSIMContext *ctx, int plane, const uint8_t *pix, int stride, int width, int height)
+{
+    int64_t t = ctx->stats ? stats_clock() : 0;
+    stride /= ctx->pixel_size;
+    switch (ctx->bit_depth)
+    {
+    case 10:
+        ms_ssim_build_ref_tmpl<10>(ctx, plane, pix, stride, width, height);
+        break;
+    case 12:
+        ms_ssim_build_ref_tmpl<12>(ctx, plane, pix, stride, width, height);
+        break;
+    case 16:
+        ms_ssim_build_ref_tmpl<16>(ctx, plane, pix, stride, width, height);
+        break;
+    default:
+        ms_ssim_build_ref_tmpl<8>(ctx, plane, pix, stride, width, height);
+        break;
+    }
+    if (ctx->stats)
+        stats_add(ctx->stats, STAGE_BUILD_REF, t);
+}
+
+/*
+ * 按ctx的位深选择对应的实例，pix1/pix2按字节寻址，stride1/stride2是以字节为单位的行跨度
+ * (比如AVFrame的linesize)；metrics不为NULL时同时输出第1层的ssim和sse
+ */
+static float ms_ssim_plane(MSSSIMContext *ctx, const uint8_t *pix1, int stride1, const uint8_t *pix2, int stride2,
+                           int width, int height, int scale = 5,
+                           PlaneMetrics *metrics = NULL, uint8_t **ref_pyramid = NULL)
+{
+    stride1 /= ctx->pixel_size;
+    stride2 /= ctx->pixel_size;
+    switch (ctx->bit_depth)
+    {
+    case 10:
+        return ms_ssim_plane_tmpl<10>(ctx, pix1, stride1, pix2, stride2, width, height, scale, metrics, ref_pyramid);
+    case 12:
+        return ms_ssim_plane_tmpl<12>(ctx, pix1, stride1, pix2, stride2, width, height, scale, metrics, ref_pyramid);
+    case 16:
+        return ms_ssim_plane_tmpl<16>(ctx, pix1, stride1, pix2, stride2, width, height, scale, metrics, ref_pyramid);
+    default:
+        return ms_ssim_plane_tmpl<8>(ctx, pix1, stride1, pix2, stride2, width, height, scale, metrics, ref_pyramid);
+    }
+}
+
+#endif /* MSSSIM_CORE_H */
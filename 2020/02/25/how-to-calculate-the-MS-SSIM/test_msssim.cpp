@@ -26,282 +26,1943 @@
  *
  * To improve speed, this implementation uses the standard approximation of
  * overlapped 8x8 block sums, rather than the original gaussian weights.
+ * The original 11x11 gaussian window (sigma = 1.5) is available with
+ * --window gaussian, as a separable, tiled float convolution.
+ *
+ * ssim_4x4x2_core and ssim_end4 have SSE4.1/AVX2 (x86) and NEON (aarch64)
+ * versions, picked at startup by ssim_dsp_init() according to the CPU.
+ * All of them are bit-exact with the C versions. Build with
+ * -DMSSSIM_NO_SIMD to force the C versions.
+ *
+ * The bit depth (8, 10, 12 or 16) is chosen at runtime with --bitdepth;
+ * inputs deeper than 8 bits are little-endian 16-bit samples (yuv420p10le
+ * etc.). Needs C++11: g++ -O2 -pthread -o ms-ssim test_msssim.cpp
+ *
+ * The scoring core is in msssim_core.h. msssim.h/msssim.cpp wrap it as a
+ * library for in-process use (one context, msssim_score_frame() per frame),
+ * and bench_msssim.cpp times its kernels with Google Benchmark.
+ *
+ * --all-metrics also prints PSNR and single-scale SSIM per plane. Both come
+ * out of the scale-1 MS-SSIM pass: the 4x4 block sums give ss - 2*s12 =
+ * sum((a-b)^2), so the pixels are only walked once per frame.
+ *
+ * More than one distorted file may follow the reference (e.g. the renditions
+ * of an ABR ladder). Each reference frame is then read once and its pyramid
+ * built once, and every distorted file is scored against it in lockstep.
+ *
+ * Built with -DCONFIG_AVFORMAT=1 (and -lavformat -lavcodec -lavutil), any
+ * input other than .yuv, .y4m or stdin is decoded in-process with libavcodec and
+ * scored straight from the decoder's AVFrame planes, without raw copies.
+ *
+ * Inputs may be stdin ("-") or FIFOs. YUV4MPEG2 (Y4M) streams are detected
+ * by their header, which supplies the size and bit depth, so e.g.
+ * ffmpeg -i x.mp4 -f yuv4mpegpipe - | ms-ssim ref.y4m -
+ * works without intermediate files. <seek> is skipped by reading when the
+ * input cannot seek.
+ *
+ * --tiled computes the whole pyramid in cache-sized stripes: each batch of
+ * TILE_ROWS input rows is scored and downsampled into small per-scale ring
+ * buffers, which are scored and downsampled in turn while still in cache, so
+ * large (8K) planes are read from memory once instead of once per scale.
+ * It gives the same scores as the default path and cannot be combined with
+ * --window gaussian or --band-threads.
+ *
+ * --dedup hashes every plane as it is read (a vectorized 64-bit hash). A frame
+ * whose reference and distorted planes all hash the same as the previous
+ * frame's reuses the previous scores, and a distorted plane bit-identical to
+ * the reference scores 1.0 without running the pyramid (not with --fast-end,
+ * whose approximate end stage gives 1.0 only to about 1e-7, so the pyramid
+ * still runs there). The number of skipped frames is reported on stderr.
+ *
+ * --frames start:count scores only frames [start, start+count) of every input,
+ * and --partial writes that shard's per-frame scores to a small binary file.
+ * "ms-ssim merge a.bin b.bin ..." replays the shards' per-frame scores in
+ * frame order, so its Total lines are bit-identical to a single run over
+ * the whole range. Shards can run on different machines.
+ *
+ * --subsample N scores one frame out of every N, either the first of each
+ * group of N (systematic) or, with --stratified, a random one (seeded by
+ * --seed). Raw inputs seek past the frames that are not scored. The Total
+ * lines are then estimates, and a 95% confidence interval for each mean is
+ * printed after them.
+ *
+ * --async-read moves reading/decoding to its own thread and prints how long
+ * the reader waited for free buffers and the scorer waited for input.
+ *
+ * Per-frame results go through a buffered sink instead of a printf/fflush per
+ * frame. --format picks text (the default "Frame n | ..." lines), csv,
+ * jsonl or bin (a compact binary stream), and --output writes them to a file
+ * instead of stdout. The live progress line is refreshed at most
+ * PROGRESS_HZ times a second; with a structured format it goes to stderr,
+ * and so do the Total lines when the results go to stdout.
+ *
+ * --stats times each stage of every frame: reading, hashing, the SSIM pass
+ * and the downsample of each scale, and the per-frame output. The breakdown
+ * (total, calls, mean, p50 and p99 per frame) goes to stderr at the end, or
+ * as JSON to a file with --stats-json. Without it the timers are not read.
+ *
+ * --fast-end (8-bit, block window, AVX2) evaluates the SSIM end stage for a
+ * whole row of windows at once, 8 per vector, with refined reciprocals in
+ * place of the divisions. It is not bit-exact: each window's terms are within
+ * 2^-21 (relative) of the exact ones, and per-plane MS-SSIM typically moves
+ * by a few 1e-7. Other depths and CPUs ignore it and use the exact path.
+ */
+
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <cstring>
+#include <strings.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#ifndef CONFIG_AVFORMAT
+#define CONFIG_AVFORMAT 0
+#endif
+#if CONFIG_AVFORMAT
+extern "C" {
+#include "libavcodec/avcodec.h"
+#include "libavformat/avformat.h"
+#include "libavutil/pixdesc.h"
+}
+#endif
+
+#include "msssim_core.h"
+
+static void print_results(FILE *f, float ms_ssim[3], int frames, int w, int h)
+{
+    fprintf(f, "MS-SSIM Y:%.5f U:%.5f V:%.5f All:%.5f",
+           ms_ssim[0] / frames,
+           ms_ssim[1] / frames,
+           ms_ssim[2] / frames,
+           (ms_ssim[0] * 4 + ms_ssim[1] + ms_ssim[2]) / (frames * 6));
+}
+
+static double psnr(uint64_t sse, double count, int pixel_max)
+{
+    if (!sse)
+        return INFINITY;
+    return 10.0 * log10((double)pixel_max * pixel_max * count / sse);
+}
+
+// sse是frames帧的累加，所以总的psnr是按平均的mse算的，不是每帧psnr的平均
+static void print_metrics(FILE *f, const PlaneMetrics metrics[3], int frames, int w, int h, int bit_depth)
+{
+    int pixel_max = (1 << bit_depth) - 1;
+    double luma   = (double)w * h * frames;
+    double chroma = (double)(w >> 1) * (h >> 1) * frames;
+
+    fprintf(f, "PSNR Y:%.3f U:%.3f V:%.3f All:%.3f SSIM Y:%.5f U:%.5f V:%.5f All:%.5f | ",
+           psnr(metrics[0].sse, luma, pixel_max),
+           psnr(metrics[1].sse, chroma, pixel_max),
+           psnr(metrics[2].sse, chroma, pixel_max),
+           psnr(metrics[0].sse + metrics[1].sse + metrics[2].sse, luma + 2 * chroma, pixel_max),
+           metrics[0].ssim / frames,
+           metrics[1].ssim / frames,
+           metrics[2].ssim / frames,
+           (metrics[0].ssim * 4 + metrics[1].ssim + metrics[2].ssim) / (frames * 6));
+}
+
+/*
+ * YUV文件的读取。能mmap的时候直接把整个文件映射进来，每一帧的平面指针直接指向映射，
+ * 省掉fread到buf[i]的那次拷贝，也不会在page cache之外再多一份缓存；
+ * 映射失败(比如管道)或者指定--no-mmap时退回到fread。
+ *
+ * 文件名为"-"时从stdin读。以"YUV4MPEG2 "开头的输入按Y4M解析，尺寸和位深取自文件头，
+ * 每帧前面的FRAME行跳过。不能seek的输入(管道、FIFO)用读掉的方式跳过开头，
+ * 内存占用与帧数无关。
+ *
+ * CONFIG_AVFORMAT时不是.yuv/.y4m的文件用libavformat/libavcodec解码，解码流程同
+ * test_video_parser_2.cpp，包括最后送空包把解码器里缓存的帧冲出来。
+ * 解码出来的AVFrame不拷贝，直接用它的data/linesize计算。
+ */
+#define READAHEAD_FRAMES 4 // 提前告诉内核需要的帧数
+
+typedef struct
+{
+    FILE    *f;
+    uint8_t *map;        // 整个文件的映射，NULL表示使用fread
+    size_t   map_size;
+    size_t   pos;        // 下一帧在文件中的偏移
+    size_t   ahead;      // MADV_WILLNEED已经覆盖到的位置
+    size_t   frame_size;
+    uint8_t *tail;       // 见frame_source_read
+    int      width;
+    int      height;
+    int      bit_depth;
+    int      y4m;
+    uint8_t  peek[10];   // fread模式下探测Y4M文件头时多读的字节，属于第一帧
+    int      peek_len;
+    long     skip;       // Y4M和解码的输入开头要丢掉的帧数
+#if CONFIG_AVFORMAT
+    AVFormatContext *fmt_ctx;    // 不为NULL表示解码
+    AVCodecContext  *dec_ctx;
+    AVPacket        *pkt;
+    int              stream_idx;
+    int              packet_new; // pkt还没有送进解码器
+    int              eof;        // 已经读完，送空包flush
+#endif
+} FrameSource;
+
+// 一帧的三个平面，linesize以字节为单位
+typedef struct
+{
+    uint8_t *data[3];
+    int      linesize[3];
+#if CONFIG_AVFORMAT
+    AVFrame *frame;      // 解码时持有的帧，同一个缓存下一次读入时才释放
+#endif
+} FramePlanes;
+
+#if CONFIG_AVFORMAT
+static int frame_source_open_decoder(FrameSource *src, const char *path)
+{
+    const AVCodec *codec;
+
+    if (avformat_open_input(&src->fmt_ctx, path, NULL, NULL) < 0)
+        return -1;
+    if (avformat_find_stream_info(src->fmt_ctx, NULL) < 0)
+        return -1;
+
+    src->stream_idx = av_find_best_stream(src->fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (src->stream_idx < 0)
+        return -1;
+
+    src->dec_ctx = avcodec_alloc_context3(NULL);
+    if (!src->dec_ctx)
+        return -1;
+    if (avcodec_parameters_to_context(src->dec_ctx, src->fmt_ctx->streams[src->stream_idx]->codecpar) < 0)
+        return -1;
+
+    codec = avcodec_find_decoder(src->dec_ctx->codec_id);
+    if (!codec || avcodec_open2(src->dec_ctx, codec, NULL) < 0)
+        return -1;
+
+    src->pkt = av_packet_alloc();
+    return src->pkt ? 0 : -1;
+}
+
+// 解码下一帧到frame，返回值同avcodec_receive_frame，读完并flush完之后返回AVERROR_EOF
+static int frame_source_decode(FrameSource *src, AVFrame *frame)
+{
+    int ret;
+
+    av_frame_unref(frame);
+    for (;;)
+    {
+        if (src->packet_new)
+        {
+            ret = avcodec_send_packet(src->dec_ctx, src->eof ? NULL : src->pkt);
+            if (ret >= 0 || ret == AVERROR_EOF)
+                src->packet_new = 0;
+            else if (ret != AVERROR(EAGAIN))
+                return ret;
+        }
+
+        ret = avcodec_receive_frame(src->dec_ctx, frame);
+        if (ret != AVERROR(EAGAIN))
+            return ret;
+        if (src->packet_new) // 既不能送包也没有帧可取
+            return AVERROR_BUG;
+
+        // 解码器需要新的包
+        av_packet_unref(src->pkt);
+        while ((ret = av_read_frame(src->fmt_ctx, src->pkt)) >= 0 && src->pkt->stream_index != src->stream_idx)
+            av_packet_unref(src->pkt);
+        if (ret < 0)
+            src->eof = 1;
+        src->packet_new = 1;
+    }
+}
+
+static enum AVPixelFormat expected_pix_fmt(int bit_depth)
+{
+    switch (bit_depth)
+    {
+    case 10:
+        return AV_PIX_FMT_YUV420P10LE;
+    case 12:
+        return AV_PIX_FMT_YUV420P12LE;
+    case 16:
+        return AV_PIX_FMT_YUV420P16LE;
+    default:
+        return AV_PIX_FMT_YUV420P;
+    }
+}
+
+static int pix_fmt_depth(int format)
+{
+    switch (format)
+    {
+    case AV_PIX_FMT_YUV420P:
+        return 8;
+    case AV_PIX_FMT_YUV420P10LE:
+        return 10;
+    case AV_PIX_FMT_YUV420P12LE:
+        return 12;
+    case AV_PIX_FMT_YUV420P16LE:
+        return 16;
+    default:
+        return 0;
+    }
+}
+
+// .yuv、.y4m和stdin自己读，其他的交给libavformat
+static int is_native_input(const char *path)
+{
+    size_t len = strlen(path);
+    return !strcmp(path, "-") ||
+           (len >= 4 && (!strcasecmp(path + len - 4, ".yuv") || !strcasecmp(path + len - 4, ".y4m")));
+}
+#endif
+
+// fread模式下的读取，先取出peek里的字节
+static size_t source_fread(FrameSource *src, uint8_t *buf, size_t size)
+{
+    size_t n = FFMIN(size, (size_t)src->peek_len);
+
+    memcpy(buf, src->peek, n);
+    memmove(src->peek, src->peek + n, src->peek_len - n);
+    src->peek_len -= n;
+    return n < size ? n + fread(buf + n, 1, size - n, src->f) : n;
+}
+
+// 不能seek的输入靠读掉来跳过
+static int source_skip(FrameSource *src, size_t size)
+{
+    uint8_t tmp[4096];
+
+    while (size)
+    {
+        size_t n = FFMIN(size, sizeof(tmp));
+        if (source_fread(src, tmp, n) != n)
+            return -1;
+        size -= n;
+    }
+    return 0;
+}
+
+// 读一行(Y4M的文件头或者FRAME行)，不含'\n'
+static int source_getline(FrameSource *src, char *line, int size)
+{
+    int len = 0;
+    uint8_t c;
+
+    if (src->map)
+    {
+        const uint8_t *p  = src->map + src->pos;
+        const uint8_t *nl = (const uint8_t *)memchr(p, '\n', FFMIN((size_t)size, src->map_size - src->pos));
+        if (!nl)
+            return -1;
+        len = nl - p;
+        memcpy(line, p, len);
+        src->pos += len + 1;
+    }
+    else
+    {
+        for (;;)
+        {
+            if (source_fread(src, &c, 1) != 1 || len >= size - 1)
+                return -1;
+            if (c == '\n')
+                break;
+            line[len++] = c;
+        }
+    }
+    line[len] = 0;
+    return len;
+}
+
+/*
+ * 解析"YUV4MPEG2 W352 H288 F30:1 Ip A0:0 C420jpeg"，只用到W、H和C，
+ * 只支持4:2:0，位深按C的后缀(420p10等，16位小端)。
+ */
+static int parse_y4m_header(FrameSource *src, int *width, int *height, int *bit_depth)
+{
+    char line[512];
+    int w = 0, h = 0, depth = 8;
+
+    if (source_getline(src, line, sizeof(line)) < 0)
+        return -1;
+
+    for (char *tok = strtok(line + 9, " "); tok; tok = strtok(NULL, " "))
+    {
+        if (tok[0] == 'W')
+            w = atoi(tok + 1);
+        else if (tok[0] == 'H')
+            h = atoi(tok + 1);
+        else if (tok[0] == 'C')
+        {
+            if (!strcmp(tok, "C420p10"))
+                depth = 10;
+            else if (!strcmp(tok, "C420p12"))
+                depth = 12;
+            else if (!strcmp(tok, "C420p16"))
+                depth = 16;
+            else if (strcmp(tok, "C420jpeg") && strcmp(tok, "C420paldv") && strcmp(tok, "C420mpeg2") && strcmp(tok, "C420"))
+            {
+                fprintf(stderr, "Unsupported Y4M chroma format %s, only 4:2:0 is supported\n", tok + 1);
+                return -1;
+            }
+        }
+    }
+
+    if (w <= 0 || h <= 0)
+        return -1;
+    if ((*width && (*width != w || *height != h)) || (*bit_depth && *bit_depth != depth))
+    {
+        fprintf(stderr, "Y4M header says %dx%d %d-bit, which does not match the size or --bitdepth given\n", w, h, depth);
+        return -1;
+    }
+    *width     = w;
+    *height    = h;
+    *bit_depth = depth;
+    src->y4m   = 1;
+    return 0;
+}
+
+/*
+ * 打开输入，width/height/bit_depth为0表示未知，由Y4M文件头(或者解码器)填上，
+ * 已知时必须与文件头一致。raw文件必须事先知道尺寸。
+ */
+static int frame_source_open(FrameSource *src, const char *path, int *width, int *height, int *bit_depth,
+                             long seek, int use_mmap)
+{
+    struct stat st;
+
+    memset(src, 0, sizeof(*src));
+
+#if CONFIG_AVFORMAT
+    if (!is_native_input(path))
+    {
+        if (frame_source_open_decoder(src, path) < 0)
+            return -1;
+        if (!*width)
+        {
+            *width  = src->dec_ctx->width;
+            *height = src->dec_ctx->height;
+        }
+        if (!*bit_depth)
+            *bit_depth = pix_fmt_depth(src->dec_ctx->pix_fmt);
+        if (*width <= 0 || *height <= 0 || !*bit_depth)
+            return -1;
+    }
+    else
+#endif
+    {
+        src->f = strcmp(path, "-") ? fopen(path, "rb") : stdin;
+        if (!src->f)
+            return -1;
+
+        if (use_mmap && !fstat(fileno(src->f), &st) && S_ISREG(st.st_mode) && st.st_size > 0)
+        {
+            void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(src->f), 0);
+            if (map != MAP_FAILED)
+            {
+                src->map      = (uint8_t *)map;
+                src->map_size = st.st_size;
+                madvise(src->map, src->map_size, MADV_SEQUENTIAL);
+            }
+        }
+
+        // 探测Y4M文件头，fread模式下多读的字节留在peek里
+        if (src->map)
+        {
+            if (src->map_size >= 10 && !memcmp(src->map, "YUV4MPEG2 ", 10) &&
+                parse_y4m_header(src, width, height, bit_depth) < 0)
+                return -1;
+        }
+        else
+        {
+            src->peek_len = fread(src->peek, 1, 10, src->f);
+            if (src->peek_len == 10 && !memcmp(src->peek, "YUV4MPEG2 ", 10) &&
+                parse_y4m_header(src, width, height, bit_depth) < 0)
+                return -1;
+        }
+
+        if (!*width)
+        {
+            fprintf(stderr, "%s is not a Y4M file, <width>x<height> is required\n", path);
+            return -1;
+        }
+        if (!*bit_depth)
+            *bit_depth = 8;
+    }
+
+    src->width      = *width;
+    src->height     = *height;
+    src->bit_depth  = *bit_depth;
+    src->frame_size = *width * (int64_t)*height * 3 / 2 * (*bit_depth > 8 ? 2 : 1);
+
+    // Y4M和解码的输入按帧跳过，raw文件按字节
+    if (src->y4m || !src->f)
+    {
+        src->skip = seek / src->frame_size;
+    }
+    else if (src->map)
+    {
+        src->pos = src->ahead = seek;
+    }
+    else if (seek || src->peek_len)
+    {
+        // 能seek就直接定位(peek里的字节作废)，不能就读掉
+        if (!fseek(src->f, seek, SEEK_SET))
+            src->peek_len = 0;
+        else if (source_skip(src, seek) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * 返回下一帧的起始地址，文件结束时返回NULL。
+ * fread模式下读到buf里并返回buf；mmap模式下直接返回映射里的地址。
+ * ssim_4x4x2_core会越过平面末尾读最多PIXEL_PADDING字节，如果最后一帧之后
+ * 映射的页里没有这么多空间，就把这一帧拷到tail里，避免越界访问。
+ */
+static uint8_t *frame_source_read(FrameSource *src, uint8_t *buf)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    char line[256];
+
+    // Y4M每帧前面有一行"FRAME[ 参数]"
+    if (src->y4m && (source_getline(src, line, sizeof(line)) < 0 || strncmp(line, "FRAME", 5)))
+        return NULL;
+
+    if (!src->map)
+        return source_fread(src, buf, src->frame_size) == src->frame_size ? buf : NULL;
+
+    if (src->pos > src->map_size || src->map_size - src->pos < src->frame_size)
+        return NULL;
+
+    uint8_t *frame = src->map + src->pos;
+    src->pos += src->frame_size;
+
+    if (src->pos + READAHEAD_FRAMES / 2 * src->frame_size > src->ahead)
+    {
+        size_t start = src->ahead & ~(page - 1);
+        size_t end   = FFMIN(src->pos + READAHEAD_FRAMES * src->frame_size, src->map_size);
+        if (end > start)
+            madvise(src->map + start, end - start, MADV_WILLNEED);
+        src->ahead = end;
+    }
+
+    if (src->pos + PIXEL_PADDING > ((src->map_size + page - 1) & ~(page - 1)))
+    {
+        if (!src->tail)
+            src->tail = (uint8_t *)malloc(src->frame_size + PIXEL_PADDING);
+        if (!src->tail)
+            return NULL;
+        memcpy(src->tail, frame, src->frame_size);
+        frame = src->tail;
+    }
+
+    return frame;
+}
+
+/*
+ * 读入下一帧的三个平面，读完或者出错时返回-1。
+ * raw文件的平面指向frame_source_read返回的地址，解码时指向planes->frame。
+ */
+static int frame_source_next(FrameSource *src, uint8_t *buf, FramePlanes *planes)
+{
+    int bps = src->bit_depth > 8 ? 2 : 1;
+
+#if CONFIG_AVFORMAT
+    if (src->fmt_ctx)
+    {
+        AVFrame *frame;
+
+        if (!planes->frame && !(planes->frame = av_frame_alloc()))
+            return -1;
+        frame = planes->frame;
+
+        do
+        {
+            if (frame_source_decode(src, frame) < 0)
+                return -1;
+        } while (src->skip-- > 0);
+        src->skip = 0;
+
+        // 不做格式转换，尺寸和像素格式必须与命令行一致
+        if (frame->width != src->width || frame->height != src->height || frame->format != expected_pix_fmt(src->bit_depth))
+        {
+            fprintf(stderr, "Decoded frame is %dx%d %s, expected %dx%d %s\n",
+                    frame->width, frame->height, av_get_pix_fmt_name((enum AVPixelFormat)frame->format),
+                    src->width, src->height, av_get_pix_fmt_name(expected_pix_fmt(src->bit_depth)));
+            return -1;
+        }
+
+        for (int i = 0; i < 3; i++)
+        {
+            planes->data[i]     = frame->data[i];
+            planes->linesize[i] = frame->linesize[i];
+        }
+        return 0;
+    }
+#endif
+
+    for (; src->skip > 0; src->skip--)
+    {
+        if (!frame_source_read(src, buf))
+            return -1;
+    }
+
+    uint8_t *data = frame_source_read(src, buf);
+    if (!data)
+        return -1;
+
+    planes->data[0]     = data;
+    planes->data[1]     = planes->data[0] + src->width * src->height * bps;
+    planes->data[2]     = planes->data[1] + src->width * src->height / 4 * bps;
+    planes->linesize[0] = src->width * bps;
+    planes->linesize[1] = src->width / 2 * bps;
+    planes->linesize[2] = src->width / 2 * bps;
+    return 0;
+}
+
+// 跳过n帧：raw文件直接移动读的位置，Y4M、解码和不能seek的输入在读的时候逐帧跳过
+static void frame_source_skip_frames(FrameSource *src, int n)
+{
+    if (src->f && !src->y4m)
+    {
+        if (src->map)
+        {
+            src->pos  += (size_t)n * src->frame_size;
+            src->ahead = src->pos;
+            return;
+        }
+        if (!src->peek_len && !fseek(src->f, (long)n * src->frame_size, SEEK_CUR))
+            return;
+    }
+    src->skip += n;
+}
+
+// 从当前位置起还剩的帧数，只有能定位的raw文件知道，其他输入(Y4M、解码、管道)返回-1
+static int frame_source_frames_left(FrameSource *src)
+{
+    struct stat st;
+    long pos;
+
+    if (!src->f || src->y4m)
+        return -1;
+    if (src->map)
+        return src->pos < src->map_size ? (src->map_size - src->pos) / src->frame_size : 0;
+    if (src->peek_len || src->skip || fstat(fileno(src->f), &st) || !S_ISREG(st.st_mode) || (pos = ftell(src->f)) < 0)
+        return -1;
+    return pos < st.st_size ? (st.st_size - pos) / src->frame_size : 0;
+}
+
+static void frame_source_close(FrameSource *src)
+{
+    if (src->map)
+        munmap(src->map, src->map_size);
+    if (src->f)
+        fclose(src->f);
+    free(src->tail);
+#if CONFIG_AVFORMAT
+    av_packet_free(&src->pkt);
+    avcodec_free_context(&src->dec_ctx);
+    avformat_close_input(&src->fmt_ctx);
+#endif
+    memset(src, 0, sizeof(*src));
+}
+
+/*
+ * --dedup：每帧每个平面算一个64位的哈希，参考和所有失真的哈希都与上一帧相同时
+ * 这一帧不计算，直接沿用上一帧的分数(同样的输入算出来的分数本来就逐位相同)，
+ * 重复帧的判断只靠哈希，碰撞的概率约为2^-64。参考和失真的某个平面完全相同
+ * (哈希相同，再用memcmp确认)时这个平面的MS-SSIM就是1.0，也不用计算。
+ *
+ * 哈希是32路并行的xxh32式的轮函数，每路每次取4个字节，每行先按128字节、
+ * 再按32字节、最后逐字节处理，与行跨度无关。AVX2版本与C版本的结果相同。
+ */
+#define HASH_LANES 32
+#define HASH_PRIME1 0x9E3779B1U
+#define HASH_PRIME2 0x85EBCA77U
+
+static inline uint32_t hash_round(uint32_t acc, uint32_t v)
+{
+    acc += v * HASH_PRIME2;
+    acc = (acc << 13) | (acc >> 19);
+    return acc * HASH_PRIME1;
+}
+
+static void hash_row_c(uint32_t acc[HASH_LANES], const uint8_t *p, int size)
+{
+    int x = 0;
+    uint32_t v;
+
+    for (; x + 4 * HASH_LANES <= size; x += 4 * HASH_LANES)
+    {
+        for (int l = 0; l < HASH_LANES; l++)
+        {
+            memcpy(&v, p + x + 4 * l, 4);
+            acc[l] = hash_round(acc[l], v);
+        }
+    }
+    for (; x + 32 <= size; x += 32)
+    {
+        for (int l = 0; l < 8; l++)
+        {
+            memcpy(&v, p + x + 4 * l, 4);
+            acc[l] = hash_round(acc[l], v);
+        }
+    }
+    for (; x < size; x++)
+        acc[x & 7] = hash_round(acc[x & 7], p[x]);
+}
+
+#if ARCH_X86
+__attribute__((target("avx2")))
+static inline __m256i hash_round_avx2(__m256i acc, __m256i v)
+{
+    acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(v, _mm256_set1_epi32(HASH_PRIME2)));
+    acc = _mm256_or_si256(_mm256_slli_epi32(acc, 13), _mm256_srli_epi32(acc, 19));
+    return _mm256_mullo_epi32(acc, _mm256_set1_epi32(HASH_PRIME1));
+}
+
+// 4个累加器互不依赖，乘法的延迟可以重叠
+__attribute__((target("avx2")))
+static void hash_row_avx2(uint32_t acc[HASH_LANES], const uint8_t *p, int size)
+{
+    __m256i a0 = _mm256_loadu_si256((const __m256i *)(acc + 0));
+    __m256i a1 = _mm256_loadu_si256((const __m256i *)(acc + 8));
+    __m256i a2 = _mm256_loadu_si256((const __m256i *)(acc + 16));
+    __m256i a3 = _mm256_loadu_si256((const __m256i *)(acc + 24));
+    int x = 0;
+
+    for (; x + 128 <= size; x += 128)
+    {
+        a0 = hash_round_avx2(a0, _mm256_loadu_si256((const __m256i *)(p + x)));
+        a1 = hash_round_avx2(a1, _mm256_loadu_si256((const __m256i *)(p + x + 32)));
+        a2 = hash_round_avx2(a2, _mm256_loadu_si256((const __m256i *)(p + x + 64)));
+        a3 = hash_round_avx2(a3, _mm256_loadu_si256((const __m256i *)(p + x + 96)));
+    }
+    for (; x + 32 <= size; x += 32)
+        a0 = hash_round_avx2(a0, _mm256_loadu_si256((const __m256i *)(p + x)));
+
+    _mm256_storeu_si256((__m256i *)(acc + 0), a0);
+    _mm256_storeu_si256((__m256i *)(acc + 8), a1);
+    _mm256_storeu_si256((__m256i *)(acc + 16), a2);
+    _mm256_storeu_si256((__m256i *)(acc + 24), a3);
+    for (; x < size; x++)
+        acc[x & 7] = hash_round(acc[x & 7], p[x]);
+}
+#endif
+
+typedef void (*HashRowFunc)(uint32_t acc[HASH_LANES], const uint8_t *p, int size);
+
+static HashRowFunc hash_row_func()
+{
+    static HashRowFunc fn;
+    static std::once_flag once;
+    std::call_once(once, [] {
+        fn = hash_row_c;
+#if ARCH_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            fn = hash_row_avx2;
+#endif
+    });
+    return fn;
+}
+
+// size是每行的字节数
+static uint64_t plane_hash(const uint8_t *p, int linesize, int size, int height)
+{
+    HashRowFunc hash_row = hash_row_func();
+    uint32_t acc[HASH_LANES];
+    uint64_t h = 0;
+
+    for (int l = 0; l < HASH_LANES; l++)
+        acc[l] = (l + 1) * HASH_PRIME1;
+    for (int y = 0; y < height; y++)
+        hash_row(acc, p + (intptr_t)y * linesize, size);
+
+    for (int l = 0; l < HASH_LANES; l++)
+    {
+        h = (h ^ acc[l]) * 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+static int plane_equal(const uint8_t *p1, int linesize1, const uint8_t *p2, int linesize2, int size, int height)
+{
+    for (int y = 0; y < height; y++)
+    {
+        if (memcmp(p1 + (intptr_t)y * linesize1, p2 + (intptr_t)y * linesize2, size))
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * 多线程模式下按帧并行：主线程负责读文件，工作线程各自持有一个MSSSIMContext计算整帧，
+ * 主线程再按帧号顺序输出和累加，所以结果与单线程完全一致。
+ *
+ * 一个参考对多个失真(比如同一个片源的多个码率档)时，每帧参考只读一次，
+ * 参考的金字塔也只建一次，然后依次和每个失真计算。
+ */
+#define MAX_DIST 16 // 最多的失真文件数
+
+/*
+ * --async-read时由单独的读线程按帧号顺序填充jobs这个环，第n帧输出之后它的缓存
+ * 才会被第n+nb_jobs帧复用，不重新分配。读线程等空闲缓存的时间和计算等输入的时间
+ * 分别累计，用来判断是IO还是计算成为瓶颈。
+ */
+typedef std::chrono::steady_clock Clock;
+
+static double seconds_since(Clock::time_point t)
+{
+    return std::chrono::duration<double>(Clock::now() - t).count();
+}
+
+// --stats：命令行自己的阶段接在核心的阶段后面
+enum
+{
+    STAGE_READ = NB_CORE_STAGES, // 读入(解码)一帧的所有文件
+    STAGE_HASH,                  // --dedup的哈希
+    STAGE_SCORE,                 // 一帧的score_frame，包含核心的各阶段
+    STAGE_OUTPUT,                // 输出一帧，包括printf/fflush和--partial
+    NB_STAGES,
+};
+
+/*
+ * 每帧结果的输出(--format)：
+ *   text  默认，与原来相同的"Frame n | ..."行，以\r结尾
+ *   csv   frame,dist,y,u,v,all，all_metrics时再加上psnr_y..psnr_all和ssim_y..ssim_all，第一行是表头
+ *   jsonl 每帧每个失真一行JSON，PSNR为无穷大(完全相同)时是null
+ *   bin   "MSSSIMR1"、int32 nb_dist、int32 all_metrics，之后每帧是int32帧号加上
+ *         与--partial相同的记录
+ * 写进--output的文件(默认stdout)，用RESULT_BUFFER大小的缓冲，不再每帧fflush：
+ * text只在刷新进度的时候fflush，结构化的格式直到结束才刷新，进度行单独写到stderr。
+ */
+#define RESULT_BUFFER (1 << 20)
+#define PROGRESS_HZ   10
+#define RESULT_MAGIC  "MSSSIMR1"
+
+enum
+{
+    FORMAT_TEXT,
+    FORMAT_CSV,
+    FORMAT_JSONL,
+    FORMAT_BIN,
+};
+
+typedef struct
+{
+    FILE *f;
+    int   format;
+    char *buf;      // f的缓冲
+    int   progress; // 结构化格式时stderr是终端才显示进度
+    int   shown;    // 显示过进度行
+    Clock::time_point last_refresh;
+} ResultSink;
+
+// 每帧各阶段的耗时，按帧的顺序在输出时收集，结束时算分位数
+typedef struct
+{
+    Clock::time_point    start;
+    std::vector<int64_t> frame_ns[NB_STAGES];
+    uint64_t             count[NB_STAGES];
+} RunStats;
+
+typedef struct
+{
+    uint8_t *buf[MAX_DIST + 1];      // 只在fread模式下分配，0为参考
+    FramePlanes planes[MAX_DIST + 1];
+    float    ms_ssim[MAX_DIST][3];
+    PlaneMetrics metrics[MAX_DIST][3]; // 只在--all-metrics时计算
+    uint64_t hash[MAX_DIST + 1][3];   // 以下只在--dedup时使用
+    int      dup;                     // 与上一帧完全相同，不计算
+    int      identical;               // 与参考完全相同的平面数
+    MSSSIMStats stats;                // 以下只在--stats时使用
+    int64_t  read_ns;
+    int64_t  hash_ns;
+    int64_t  score_ns;
+    int      index;                   // 在输入中的帧号(相对--frames的起始帧)
+    int      done;
+} FrameJob;
+
+typedef struct
+{
+    std::mutex              mutex;
+    std::condition_variable job_cond;  // 有新的帧或者需要退出
+    std::condition_variable done_cond; // 有帧计算完成
+    std::vector<std::thread> workers;
+    FrameJob *jobs;
+    int       nb_jobs;
+    int       submitted; // 已经读入的帧数
+    int       next;      // 下一个待计算的帧
+    int       quit;
+
+    // 以下只在--async-read时使用
+    std::condition_variable read_cond;  // 有缓存空出来
+    std::condition_variable ready_cond; // 有新读入的帧或者已经读完
+    FrameSource *src;
+    int       nb_files;
+    int       output;         // 已经输出的帧数，output + nb_jobs之前的缓存都可以读入
+    int       read_eof;
+    double    read_time;      // 读线程花在读文件/解码上的时间
+    double    producer_stall; // 读线程等空闲缓存的时间
+    double    consumer_stall; // 计算等输入的时间，多线程时是所有工作线程的和
+
+    int       w, h;
+    int       nb_dist;
+    int       band_threads; // 每个工作线程内部再分带并行
+    int       bit_depth;
+    int       window;
+    int       tiled;
+    int       fast_end;
+    int       all_metrics;
+
+    // 以下只在--dedup时使用，last_hash只由读的线程访问，last_ms_ssim/last_metrics只在输出时访问
+    int       dedup;
+    int       have_last;
+    uint64_t  last_hash[MAX_DIST + 1][3];
+    float     last_ms_ssim[MAX_DIST][3];
+    PlaneMetrics last_metrics[MAX_DIST][3];
+    int       dup_frames;
+    int       identical_planes;
+
+    int       first_frame; // --frames的起始帧号，只影响输出的帧号
+    int       max_frames;  // 最多读入的帧数(抽样时是帧号的范围)，0为不限
+
+    // 以下只在--subsample时使用
+    int       subsample;   // 每subsample帧取一帧，1为不抽样
+    int       stratified;  // 在每subsample帧里随机取一帧，否则取第一帧
+    uint64_t  rng;
+    int       pos;         // 下一次读入的帧号(相对--frames的起始帧)
+    FrameJob  spare;       // 帧数未知时分层抽样逐帧读的另一份缓存，见read_sample
+    double    sample_sum[MAX_DIST][4]; // 每帧Y/U/V/All的和与平方和，算置信区间用
+    double    sample_sq[MAX_DIST][4];
+    FILE     *partial;     // --partial的输出
+    RunStats *stats;       // --stats，不用时为NULL
+    ResultSink *sink;
+} FramePool;
+
+// 读入一帧之后算哈希，判断是否与上一帧相同
+static void hash_frame(FramePool *pool, FrameJob *job)
+{
+    int bps = pool->bit_depth > 8 ? 2 : 1;
+    int dup = pool->have_last;
+
+    for (int k = 0; k <= pool->nb_dist; k++)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            job->hash[k][i] = plane_hash(job->planes[k].data[i], job->planes[k].linesize[i],
+                                         (pool->w >> !!i) * bps, pool->h >> !!i);
+            dup = dup && job->hash[k][i] == pool->last_hash[k][i];
+        }
+    }
+    memcpy(pool->last_hash, job->hash, sizeof(job->hash));
+    pool->have_last = 1;
+    job->dup = dup;
+    job->identical = 0;
+}
+
+static void score_planes(MSSSIMContext *ctx, const FramePool *pool, FrameJob *job)
+{
+    int w = pool->w;
+    int h = pool->h;
+    int bps = pool->bit_depth > 8 ? 2 : 1;
+
+    if (job->dup)
+        return;
+
+    if (ctx->ref_cache)
+    {
+        for (int i = 0; i < 3; i++)
+            ms_ssim_build_ref(ctx, i, job->planes[0].data[i], job->planes[0].linesize[i], w >> !!i, h >> !!i);
+    }
+
+    for (int k = 0; k < pool->nb_dist; k++)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            const FramePlanes *ref = &job->planes[0], *dist = &job->planes[k + 1];
+            if (pool->dedup && !pool->fast_end && job->hash[0][i] == job->hash[k + 1][i] &&
+                plane_equal(ref->data[i], ref->linesize[i], dist->data[i], dist->linesize[i], (w >> !!i) * bps, h >> !!i))
+            {
+                // 完全相同的平面每个窗口的L、C_S都正好是1，与精确的end stage计算的结果相同；
+                // --fast-end的倒数近似只是接近1，所以不走这里
+                job->ms_ssim[k][i] = 1.0;
+                job->metrics[k][i].sse  = 0;
+                job->metrics[k][i].ssim = 1.0;
+                job->identical++;
+                continue;
+            }
+            job->ms_ssim[k][i] = ms_ssim_plane(ctx, ref->data[i], ref->linesize[i], dist->data[i], dist->linesize[i],
+                                               w >> !!i, h >> !!i, MAX_SCALE, pool->all_metrics ? &job->metrics[k][i] : NULL,
+                                               ctx->ref_cache ? ctx->ref_pyramid[i] : NULL);
+        }
+    }
+}
+
+static void score_frame(MSSSIMContext *ctx, const FramePool *pool, FrameJob *job)
+{
+    if (!pool->stats)
+    {
+        score_planes(ctx, pool, job);
+        return;
+    }
+
+    memset(&job->stats, 0, sizeof(job->stats));
+    ctx->stats = &job->stats;
+    int64_t t = stats_clock();
+    score_planes(ctx, pool, job);
+    job->score_ns = stats_clock() - t;
+}
+
+static void frame_worker(FramePool *pool)
+{
+    MSSSIMContext ctx;
+    if (ms_ssim_init(&ctx, pool->w, pool->h, pool->bit_depth, pool->window, pool->band_threads, pool->nb_dist > 1, pool->tiled, pool->fast_end) < 0)
+    {
+        fprintf(stderr, "Failed to allocate MS-SSIM context\n");
+        exit(-3);
+    }
+
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    for (;;)
+    {
+        Clock::time_point t = Clock::now();
+        pool->job_cond.wait(lock, [pool] { return pool->next < pool->submitted || pool->quit; });
+        if (pool->next >= pool->submitted)
+            break;
+        pool->consumer_stall += seconds_since(t);
+
+        FrameJob *job = &pool->jobs[pool->next++ % pool->nb_jobs];
+        lock.unlock();
+        score_frame(&ctx, pool, job);
+        lock.lock();
+        job->done = 1;
+        pool->done_cond.notify_all();
+    }
+
+    ms_ssim_uninit(&ctx);
+}
+
+static void submit_frame(FramePool *pool, FrameJob *job)
+{
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    job->done = 0;
+    pool->submitted++;
+    pool->job_cond.notify_one();
+    pool->ready_cond.notify_all();
+}
+
+// 读入一帧的所有文件，任何一个文件读完就返回-1
+static int read_frame(FrameSource *src, int nb_files, FrameJob *job)
+{
+    for (int i = 0; i < nb_files; i++)
+    {
+        if (frame_source_next(&src[i], job->buf[i], &job->planes[i]) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+// 分层抽样用的随机数(PCG的LCG加上xorshift的输出)，同一个--seed每次取的帧都一样
+static uint32_t sample_random(uint64_t *state)
+{
+    *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (uint32_t)((*state ^ (*state >> 22)) >> 32);
+}
+
+/*
+ * 读入第n个要计算的帧：--subsample时它是第n组subsample帧里的第一帧(或随机的一帧)，
+ * 先跳过前面不取的帧，raw文件直接seek过去。超出--frames的范围或者读完时返回-1。
+ *
+ * 分层抽样时最后一组可能不满subsample帧，也要取到一帧：知道帧数时(raw文件、--frames)
+ * 在实际的帧数里随机取；不知道时从组的开头逐帧读到随机的那一帧，输入提前结束就用
+ * 最后读到的一帧。逐帧读的时候先读到pool->spare里，所有文件都读到了再与job交换。
  */
+static int read_sample(FramePool *pool, FrameSource *src, int nb_files, FrameJob *job, int n)
+{
+    int index = n;
+
+    if (pool->subsample > 1)
+    {
+        index = n * pool->subsample;
+        if (pool->stratified)
+        {
+            int start = index;
+            int size  = pool->subsample;
+            int left  = INT_MAX;
+
+            if (pool->max_frames)
+                size = FFMIN(size, pool->max_frames - start);
+            for (int i = 0; left >= 0 && i < nb_files; i++)
+            {
+                int k = frame_source_frames_left(&src[i]);
+                left  = k < 0 ? -1 : FFMIN(left, k - (start - pool->pos));
+            }
+            if (left >= 0)
+                size = FFMIN(size, left);
+            if (size <= 0)
+                return -1;
+            index += sample_random(&pool->rng) % size;
+
+            if (left < 0 && index > start)
+            {
+                for (int i = 0; start > pool->pos && i < nb_files; i++)
+                    frame_source_skip_frames(&src[i], start - pool->pos);
+                for (int k = start; k <= index; k++)
+                {
+                    if (read_frame(src, nb_files, &pool->spare) < 0)
+                    {
+                        if (k == start)
+                            return -1;
+                        break;
+                    }
+                    for (int i = 0; i < nb_files; i++)
+                    {
+                        std::swap(job->buf[i], pool->spare.buf[i]);
+                        std::swap(job->planes[i], pool->spare.planes[i]);
+                    }
+                    job->index = k;
+                    pool->pos  = k + 1;
+                }
+                return 0;
+            }
+        }
+    }
+    if (pool->max_frames && index >= pool->max_frames)
+        return -1;
+
+    for (int i = 0; index > pool->pos && i < nb_files; i++)
+        frame_source_skip_frames(&src[i], index - pool->pos);
+    if (read_frame(src, nb_files, job) < 0)
+        return -1;
+    job->index = index;
+    pool->pos  = index + 1;
+    return 0;
+}
+
+// mmap的帧在读线程里把每一页都访问一遍，缺页的IO就不会落到计算线程上
+static void prefault(const uint8_t *p, size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    volatile uint8_t sink = 0;
+    for (size_t i = 0; i < size; i += page)
+        sink = sink + p[i];
+}
+
+static void frame_reader(FramePool *pool)
+{
+    for (int n = 0;; n++)
+    {
+        FrameJob *job = &pool->jobs[n % pool->nb_jobs];
+        {
+            Clock::time_point t = Clock::now();
+            std::unique_lock<std::mutex> lock(pool->mutex);
+            pool->read_cond.wait(lock, [pool, n] { return n < pool->output + pool->nb_jobs; });
+            pool->producer_stall += seconds_since(t);
+        }
+
+        Clock::time_point t = Clock::now();
+        int ret = read_sample(pool, pool->src, pool->nb_files, job, n);
+        for (int i = 0; !ret && i < pool->nb_files; i++)
+        {
+            if (pool->src[i].map)
+                prefault(job->planes[i].data[0], pool->src[i].frame_size);
+        }
+        if (pool->stats)
+            job->read_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - t).count();
+        if (!ret && pool->dedup)
+        {
+            int64_t th = pool->stats ? stats_clock() : 0;
+            hash_frame(pool, job);
+            if (pool->stats)
+                job->hash_ns = stats_clock() - th;
+        }
+        pool->read_time += seconds_since(t);
+        if (ret < 0)
+        {
+            std::lock_guard<std::mutex> lock(pool->mutex);
+            pool->read_eof = 1;
+            pool->ready_cond.notify_all();
+            break;
+        }
+        submit_frame(pool, job);
+    }
+}
+
+// 等读线程读入第n帧，读完了返回-1
+static int wait_frame(FramePool *pool, int n)
+{
+    Clock::time_point t = Clock::now();
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    pool->ready_cond.wait(lock, [pool, n] { return n < pool->submitted || pool->read_eof; });
+    if (pool->workers.empty())
+        pool->consumer_stall += seconds_since(t);
+    return n < pool->submitted ? 0 : -1;
+}
 
-#include <inttypes.h>
-#include <limits.h>
-#include <math.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <cstring>
+static void write_partial_frame(FramePool *pool, FrameJob *job);
+static int write_partial_record(FILE *f, int nb_dist, int all_metrics, float ms_ssim[][3], PlaneMetrics metrics[][3]);
 
-#define FFSWAP(type, a, b) \
-    do                     \
-    {                      \
-        type SWAP_tmp = b; \
-        b = a;             \
-        a = SWAP_tmp;      \
-    } while (0)
-#define FFMIN(a, b) ((a) > (b) ? (b) : (a))
+static int open_sink(ResultSink *sink, const char *path, int format, int nb_dist, int all_metrics)
+{
+    sink->format = format;
+    sink->shown  = 0;
+    sink->progress = format != FORMAT_TEXT && isatty(STDERR_FILENO);
+    sink->last_refresh = Clock::now();
+    sink->f = path ? fopen(path, format == FORMAT_BIN ? "wb" : "w") : stdout;
+    sink->buf = (char *)malloc(RESULT_BUFFER);
+    if (!sink->f || !sink->buf || setvbuf(sink->f, sink->buf, _IOFBF, RESULT_BUFFER))
+        return -1;
 
-#define BIT_DEPTH 8                      // 位深 使用几位来定位一个像素点 8位的话 像素值范围就是0-255
-#define PIXEL_MAX ((1 << BIT_DEPTH) - 1) // 像素值最大值 公式里的L
-typedef uint8_t pixel;                   // 8位无符号 表示像素值
+    if (format == FORMAT_CSV)
+    {
+        fprintf(sink->f, "frame,dist,y,u,v,all%s\n",
+                all_metrics ? ",psnr_y,psnr_u,psnr_v,psnr_all,ssim_y,ssim_u,ssim_v,ssim_all" : "");
+    }
+    else if (format == FORMAT_BIN)
+    {
+        int32_t hdr[2] = {nb_dist, all_metrics};
+        if (fwrite(RESULT_MAGIC, 8, 1, sink->f) != 1 || fwrite(hdr, sizeof(hdr), 1, sink->f) != 1)
+            return -1;
+    }
+    return 0;
+}
 
-const float WEIGHT[] = {0.0448, 0.2856, 0.3001, 0.2363, 0.1333};
+static int close_sink(ResultSink *sink)
+{
+    int ret = 0;
 
-typedef struct
+    if (sink->shown)
+        fputc('\n', stderr);
+    if (sink->f && (fflush(sink->f) || ferror(sink->f)))
+        ret = -1;
+    if (sink->f && sink->f != stdout)
+    {
+        if (fclose(sink->f))
+            ret = -1;
+        free(sink->buf);
+    }
+    // stdout之后还要用这个缓冲(Total行)，不释放
+    sink->f = NULL;
+    return ret;
+}
+
+// 距离上次刷新超过1/PROGRESS_HZ秒时返回1
+static int sink_refresh_due(ResultSink *sink)
+{
+    Clock::time_point now = Clock::now();
+    if (now - sink->last_refresh < std::chrono::milliseconds(1000 / PROGRESS_HZ))
+        return 0;
+    sink->last_refresh = now;
+    return 1;
+}
+
+// JSON没有inf，完全相同的平面的PSNR写成null
+static void json_psnr(FILE *f, const char *key, double v)
 {
-    float L;
-    float C_S;
-} ssim_value;
+    if (isinf(v))
+        fprintf(f, "\"%s\":null", key);
+    else
+        fprintf(f, "\"%s\":%.6f", key, v);
+}
 
-/****************************************************************************
- * structural similarity metric
- ****************************************************************************/
-static void ssim_4x4x2_core(const pixel *pix1, intptr_t stride1,
-                            const pixel *pix2, intptr_t stride2,
-                            int sums[2][4])
+static void write_frame(const FramePool *pool, ResultSink *sink, int frame, FrameJob *job, int w, int h)
 {
-    int x, y, z;
+    FILE *f = sink->f;
+    int pixel_max = (1 << pool->bit_depth) - 1;
+    double luma   = (double)w * h;
+    double chroma = (double)(w >> 1) * (h >> 1);
+
+    if (sink->format == FORMAT_TEXT)
+    {
+        fprintf(f, "Frame %d | ", frame);
+        for (int k = 0; k < pool->nb_dist; k++)
+        {
+            if (pool->nb_dist > 1)
+                fprintf(f, "%s#%d ", k ? " | " : "", k + 1);
+            if (pool->all_metrics)
+                print_metrics(f, job->metrics[k], 1, w, h, pool->bit_depth);
+            print_results(f, job->ms_ssim[k], 1, w, h);
+        }
+        fprintf(f, "                \r");
+        if (sink_refresh_due(sink))
+            fflush(f);
+        return;
+    }
+
+    if (sink->format == FORMAT_BIN)
+    {
+        int32_t n = frame;
+        if (fwrite(&n, sizeof(n), 1, f) != 1)
+            return;
+        write_partial_record(f, pool->nb_dist, pool->all_metrics, job->ms_ssim, job->metrics);
+    }
 
-    for (z = 0; z < 2; z++)
+    for (int k = 0; sink->format != FORMAT_BIN && k < pool->nb_dist; k++)
     {
-        uint32_t s1 = 0, s2 = 0, ss = 0, s12 = 0;
-        for (y = 0; y < 4; y++)
-            for (x = 0; x < 4; x++)
+        const float *v = job->ms_ssim[k];
+        const PlaneMetrics *m = job->metrics[k];
+        float all = (v[0] * 4 + v[1] + v[2]) / 6;
+        double psnr_v[4] = {psnr(m[0].sse, luma, pixel_max), psnr(m[1].sse, chroma, pixel_max), psnr(m[2].sse, chroma, pixel_max),
+                            psnr(m[0].sse + m[1].sse + m[2].sse, luma + 2 * chroma, pixel_max)};
+        float ssim_all = (m[0].ssim * 4 + m[1].ssim + m[2].ssim) / 6;
+
+        if (sink->format == FORMAT_CSV)
+        {
+            fprintf(f, "%d,%d,%.9g,%.9g,%.9g,%.9g", frame, k + 1, v[0], v[1], v[2], all);
+            if (pool->all_metrics)
+                fprintf(f, ",%.6f,%.6f,%.6f,%.6f,%.9g,%.9g,%.9g,%.9g", psnr_v[0], psnr_v[1], psnr_v[2], psnr_v[3],
+                        m[0].ssim, m[1].ssim, m[2].ssim, ssim_all);
+            fputc('\n', f);
+        }
+        else
+        {
+            fprintf(f, "{\"frame\":%d,\"dist\":%d,\"ms_ssim\":{\"y\":%.9g,\"u\":%.9g,\"v\":%.9g,\"all\":%.9g}",
+                    frame, k + 1, v[0], v[1], v[2], all);
+            if (pool->all_metrics)
             {
-                int a = pix1[x + y * stride1];
-                int b = pix2[x + y * stride2];
-                s1 += a;
-                s2 += b;
-                ss += a * a;
-                ss += b * b;
-                s12 += a * b;
+                static const char *const keys[4] = {"y", "u", "v", "all"};
+                fprintf(f, ",\"psnr\":{");
+                for (int i = 0; i < 4; i++)
+                {
+                    json_psnr(f, keys[i], psnr_v[i]);
+                    if (i < 3)
+                        fputc(',', f);
+                }
+                fprintf(f, "},\"ssim\":{\"y\":%.9g,\"u\":%.9g,\"v\":%.9g,\"all\":%.9g}", m[0].ssim, m[1].ssim, m[2].ssim, ssim_all);
             }
-        sums[z][0] = s1;
-        sums[z][1] = s2;
-        sums[z][2] = ss;
-        sums[z][3] = s12;
-        pix1 += 4;
-        pix2 += 4;
-    }
-}
-
-static ssim_value ssim_end1(int s1, int s2, int ss, int s12)
-{
-    ssim_value value;
-/* Maximum value for 10-bit is: ss*64 = (2^10-1)^2*16*4*64 = 4286582784, which will overflow in some cases.
- * s1*s1, s2*s2, and s1*s2 also obtain this value for edge cases: ((2^10-1)*16*4)^2 = 4286582784.
- * Maximum value for 9-bit is: ss*64 = (2^9-1)^2*16*4*64 = 1069551616, which will not overflow. */
-#if BIT_DEPTH > 9
-    typedef double type;
-    static const double ssim_c1 = .01 * .01 * PIXEL_MAX * PIXEL_MAX * 64 * 64;
-    static const double ssim_c2 = .03 * .03 * PIXEL_MAX * PIXEL_MAX * 64 * 63;
-#else
-    typedef int type;
-    // k1=0.01, k2=0.03
-    static const int ssim_c1 = (int)(.01 * .01 * PIXEL_MAX * PIXEL_MAX * 64 * 64 + .5);
-    static const int ssim_c2 = (int)(.03 * .03 * PIXEL_MAX * PIXEL_MAX * 64 * 63 + .5);
-#endif
-    type fs1 = s1;
-    type fs2 = s2;
-    type fss = ss;
-    type fs12 = s12;
-    type vars = fss * 64 - fs1 * fs1 - fs2 * fs2;
-    type covar = fs12 * 64 - fs1 * fs2;
-    
-    value.L = (float)(2 * fs1 * fs2 + ssim_c1) / (float)(fs1 * fs1 + fs2 * fs2 + ssim_c1);
-    value.C_S = (float)(2 * covar + ssim_c2) / (float)(vars + ssim_c2);
+            fprintf(f, "}\n");
+        }
+    }
 
-    return value;
+    if (sink->progress && sink_refresh_due(sink))
+    {
+        const float *v = job->ms_ssim[0];
+        fprintf(stderr, "Frame %d | MS-SSIM All:%.5f                \r", frame, (v[0] * 4 + v[1] + v[2]) / 6);
+        sink->shown = 1;
+    }
 }
 
-static ssim_value ssim_end4(int sum0[5][4], int sum1[5][4], int width)
+// 按帧的顺序收集第n帧各阶段的耗时
+static void collect_stats(FramePool *pool, FrameJob *job, int64_t output_ns)
 {
-    ssim_value ssim;
-    ssim.L = 0.0;
-    ssim.C_S = 0.0;
+    RunStats *stats = pool->stats;
 
-    int i;
-    for (i = 0; i < width; i++)
+    for (int s = 0; s < NB_CORE_STAGES; s++)
     {
-        ssim_value tmp;
-        tmp = ssim_end1(sum0[i][0] + sum0[i + 1][0] + sum1[i][0] + sum1[i + 1][0],
-                        sum0[i][1] + sum0[i + 1][1] + sum1[i][1] + sum1[i + 1][1],
-                        sum0[i][2] + sum0[i + 1][2] + sum1[i][2] + sum1[i + 1][2],
-                        sum0[i][3] + sum0[i + 1][3] + sum1[i][3] + sum1[i + 1][3]);
-        ssim.L   += tmp.L;
-        ssim.C_S += tmp.C_S;
+        stats->frame_ns[s].push_back(job->stats.ns[s]);
+        stats->count[s] += job->stats.count[s];
     }
-
-    return ssim;
+    stats->frame_ns[STAGE_READ].push_back(job->read_ns);
+    stats->count[STAGE_READ]++;
+    if (pool->dedup)
+    {
+        stats->frame_ns[STAGE_HASH].push_back(job->hash_ns);
+        stats->count[STAGE_HASH]++;
+    }
+    stats->frame_ns[STAGE_SCORE].push_back(job->score_ns);
+    stats->count[STAGE_SCORE] += !job->dup;
+    stats->frame_ns[STAGE_OUTPUT].push_back(output_ns);
+    stats->count[STAGE_OUTPUT]++;
 }
 
-ssim_value ssim_plane(
-    pixel *pix1, intptr_t stride1,
-    pixel *pix2, intptr_t stride2,
-    int width, int height, void *buf, int *cnt)
+// 等第n帧算完，输出并累加到ms_ssim和metrics，多个失真时每个失真一段，用序号区分
+static void output_frame(FramePool *pool, int n, float ms_ssim[][3], PlaneMetrics metrics[][3], int w, int h)
 {
-    int z = 0;
-    int x, y;
-    ssim_value ssim;
-    ssim.L = 0.0;
-    ssim.C_S = 0.0;
+    FrameJob *job = &pool->jobs[n % pool->nb_jobs];
+
+    if (!pool->workers.empty())
+    {
+        std::unique_lock<std::mutex> lock(pool->mutex);
+        pool->done_cond.wait(lock, [job] { return job->done; });
+    }
+
+    int64_t t = pool->stats ? stats_clock() : 0;
+    if (job->dup)
+    {
+        memcpy(job->ms_ssim, pool->last_ms_ssim, sizeof(job->ms_ssim));
+        memcpy(job->metrics, pool->last_metrics, sizeof(job->metrics));
+        pool->dup_frames++;
+    }
+    else if (pool->dedup)
+    {
+        memcpy(pool->last_ms_ssim, job->ms_ssim, sizeof(job->ms_ssim));
+        memcpy(pool->last_metrics, job->metrics, sizeof(job->metrics));
+        pool->identical_planes += job->identical;
+    }
 
-    int(*sum0)[4] = (int(*)[4])buf; 
-    int(*sum1)[4] = sum0 + (width >> 2) + 3;
-    width >>= 2;
-    height >>= 2; 
-    for (y = 1; y < height; y++)
+    if (pool->partial)
+        write_partial_frame(pool, job);
+
+    for (int k = 0; k < pool->nb_dist; k++)
     {
-        for (; z <= y; z++)
+        for (int i = 0; i < 3; i++)
+            ms_ssim[k][i] += job->ms_ssim[k][i];
+
+        if (pool->subsample > 1)
+        {
+            const float *v = job->ms_ssim[k];
+            double x[4] = {v[0], v[1], v[2], (v[0] * 4 + v[1] + v[2]) / 6};
+            for (int i = 0; i < 4; i++)
+            {
+                pool->sample_sum[k][i] += x[i];
+                pool->sample_sq[k][i]  += x[i] * x[i];
+            }
+        }
+
+        if (pool->all_metrics)
         {
-            // FFSWAP( (int (*)[4]), sum0, sum1 );
-            int(*tmp)[4] = sum0;
-            sum0 = sum1;
-            sum1 = tmp;
+            for (int i = 0; i < 3; i++)
+            {
+                metrics[k][i].sse  += job->metrics[k][i].sse;
+                metrics[k][i].ssim += job->metrics[k][i].ssim;
+            }
+        }
+    }
+    write_frame(pool, pool->sink, pool->first_frame + job->index, job, w, h);
+    if (pool->stats)
+        collect_stats(pool, job, stats_clock() - t);
+
+    // 第n帧的缓存可以给读线程复用了
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    pool->output = n + 1;
+    pool->read_cond.notify_one();
+}
+
+/*
+ * 分片：--frames start:count只计算每个输入的第start帧开始的count帧，--partial把
+ * 每帧的分数和累加的结果写成二进制文件，merge把多个分片按帧号顺序合并。
+ * float的累加与顺序有关，所以合并时不是把各分片的和相加，而是按帧的顺序重新
+ * 累加每帧的分数，得到的结果与一次算完所有帧逐位相同。分片里的和用来校验文件。
+ *
+ * 文件格式(本机字节序)：
+ *   PartialHeader
+ *   nb_dist个失真文件名，每个是int32长度加上字符串
+ *   frames条记录，每条是每个失真的float ms_ssim[3]，all_metrics时再加上
+ *     uint64 sse[3]和float ssim[3]
+ *   与记录格式相同的一条，是这个分片自己累加的结果
+ */
+#define PARTIAL_MAGIC "MSSSIMP2" // P2加了fast_end
 
-            for (x = 0; x < width; x += 2)
-                ssim_4x4x2_core(&pix1[4 * (x + z * stride1)], stride1, &pix2[4 * (x + z * stride2)], stride2, &sum0[x]);
+typedef struct
+{
+    char    magic[8];
+    int32_t width;
+    int32_t height;
+    int32_t bit_depth;
+    int32_t window;
+    int32_t fast_end;    // --fast-end的分数是近似的，不能与精确的合并
+    int32_t nb_dist;
+    int32_t all_metrics;
+    int32_t start;
+    int32_t frames;
+} PartialHeader;
+
+static int write_partial_record(FILE *f, int nb_dist, int all_metrics, float ms_ssim[][3], PlaneMetrics metrics[][3])
+{
+    for (int k = 0; k < nb_dist; k++)
+    {
+        if (fwrite(ms_ssim[k], sizeof(float), 3, f) != 3)
+            return -1;
+        for (int i = 0; all_metrics && i < 3; i++)
+        {
+            if (fwrite(&metrics[k][i].sse, sizeof(uint64_t), 1, f) != 1 || fwrite(&metrics[k][i].ssim, sizeof(float), 1, f) != 1)
+                return -1;
         }
+    }
+    return 0;
+}
 
-        for (x = 0; x < width - 1; x += 4)
+static int read_partial_record(FILE *f, int nb_dist, int all_metrics, float ms_ssim[][3], PlaneMetrics metrics[][3])
+{
+    for (int k = 0; k < nb_dist; k++)
+    {
+        if (fread(ms_ssim[k], sizeof(float), 3, f) != 3)
+            return -1;
+        for (int i = 0; all_metrics && i < 3; i++)
         {
-            ssim_value tmp;
-            tmp = ssim_end4(sum0 + x, sum1 + x, FFMIN(4, width - x - 1));
-            ssim.L   += tmp.L;
-            ssim.C_S += tmp.C_S;
+            if (fread(&metrics[k][i].sse, sizeof(uint64_t), 1, f) != 1 || fread(&metrics[k][i].ssim, sizeof(float), 1, f) != 1)
+                return -1;
         }
     }
+    return 0;
+}
+
+// 文件头里的帧数在结束时由finish_partial()填上，所以--partial必须是普通文件
+static int start_partial(FramePool *pool, const char *path, const char *const *names)
+{
+    PartialHeader hdr;
+
+    pool->partial = fopen(path, "wb");
+    if (!pool->partial)
+        return -1;
 
-    ssim.L /= (height - 1) * (width - 1);
-    ssim.C_S /= (height - 1) * (width - 1);
-    return ssim;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, PARTIAL_MAGIC, sizeof(hdr.magic));
+    hdr.width       = pool->w;
+    hdr.height      = pool->h;
+    hdr.bit_depth   = pool->bit_depth;
+    hdr.window      = pool->window;
+    hdr.fast_end    = pool->fast_end;
+    hdr.nb_dist     = pool->nb_dist;
+    hdr.all_metrics = pool->all_metrics;
+    hdr.start       = pool->first_frame;
+    if (fwrite(&hdr, sizeof(hdr), 1, pool->partial) != 1)
+        return -1;
+    for (int k = 0; k < pool->nb_dist; k++)
+    {
+        int32_t len = strlen(names[k]);
+        if (fwrite(&len, sizeof(len), 1, pool->partial) != 1 || fwrite(names[k], 1, len, pool->partial) != (size_t)len)
+            return -1;
+    }
+    return 0;
 }
 
-static void print_results(float ms_ssim[3], int frames, int w, int h)
+static void write_partial_frame(FramePool *pool, FrameJob *job)
 {
-    printf("MS-SSIM Y:%.5f U:%.5f V:%.5f All:%.5f",
-           ms_ssim[0] / frames,
-           ms_ssim[1] / frames,
-           ms_ssim[2] / frames,
-           (ms_ssim[0] * 4 + ms_ssim[1] + ms_ssim[2]) / (frames * 6));
+    if (write_partial_record(pool->partial, pool->nb_dist, pool->all_metrics, job->ms_ssim, job->metrics) < 0)
+    {
+        fprintf(stderr, "Failed to write the partial results\n");
+        exit(-4);
+    }
+}
+
+static int finish_partial(FramePool *pool, int frames, float ms_ssim[][3], PlaneMetrics metrics[][3])
+{
+    int32_t n = frames;
+    FILE *f = pool->partial;
+    int ret = write_partial_record(f, pool->nb_dist, pool->all_metrics, ms_ssim, metrics);
+
+    if (!ret && (fseek(f, offsetof(PartialHeader, frames), SEEK_SET) || fwrite(&n, sizeof(n), 1, f) != 1))
+        ret = -1;
+    if (fclose(f))
+        ret = -1;
+    pool->partial = NULL;
+    return ret;
+}
+
+static void print_totals(FILE *f, float ms_ssim[][3], PlaneMetrics metrics[][3], int nb_dist, const char *const *names,
+                         int frames, int w, int h, int bit_depth, int all_metrics)
+{
+    for (int k = 0; k < nb_dist; k++)
+    {
+        fprintf(f, "Total %d frames | ", frames);
+        if (nb_dist > 1)
+            fprintf(f, "%s | ", names[k]);
+        if (all_metrics)
+            print_metrics(f, metrics[k], frames, w, h, bit_depth);
+        print_results(f, ms_ssim[k], frames, w, h);
+        fprintf(f, "\n");
+    }
 }
 
-static void downsample_2x2_mean(pixel *input, int width, int height, pixel *output) 
+/*
+ * --subsample：每个平均值的95%置信区间，mean ± 1.96 * s / sqrt(n)，s是抽到的帧的样本标准差。
+ * 把抽样当作简单随机抽样、不做有限总体校正，只是近似：内容缓慢变化时区间通常偏宽，
+ * 但内容有接近subsample的周期时，等距抽样的实际误差可能远大于区间。少于2帧时没有区间。
+ */
+static void print_confidence(FILE *f, const FramePool *pool, const char *const *names, int frames)
 {
-    int downsample_width =  width >> 1;
-    int downsample_height = height >> 1;
+    static const char *const planes[4] = {"Y", "U", "V", "All"};
 
-    for (int y = 0; y < downsample_height; y++) 
+    for (int k = 0; k < pool->nb_dist; k++)
     {
-        for (int x =0; x < downsample_width; x++) 
+        fprintf(f, "Subsample %s1/%d: %d frames | ", pool->stratified ? "random " : "", pool->subsample, frames);
+        if (pool->nb_dist > 1)
+            fprintf(f, "%s | ", names[k]);
+        fprintf(f, "MS-SSIM 95%% CI");
+        for (int i = 0; i < 4; i++)
         {
-            output[y * downsample_width + x] = (input[2 * y * width + 2 * x] +
-                                                input[2 * y * width + 2 * x + 1] +
-                                                input[(2 * y + 1) * width + 2 * x] +
-                                                input[(2 * y + 1) * width + 2 * x + 1]) / 4;
+            double mean = pool->sample_sum[k][i] / frames;
+            if (frames < 2)
+            {
+                fprintf(f, " %s:%.5f+-n/a", planes[i], mean);
+                continue;
+            }
+            double var = FFMAX(pool->sample_sq[k][i] - pool->sample_sum[k][i] * mean, 0.0) / (frames - 1);
+            fprintf(f, " %s:%.5f+-%.5f", planes[i], mean, 1.96 * sqrt(var / frames));
         }
+        fprintf(f, "\n");
     }
 }
 
-static float ms_ssim_plane(pixel *pix1, pixel *pix2, int width, int height, int scale = 5)
+typedef struct
 {
-    ssim_value value;
-    float result = 1.0;
-    float luminance_value[5];
-    int w = width;
-    int h = height;
-
-    int   *temp;
-    pixel *ori_img1;
-    pixel *ori_img2;
-    pixel *sample_img1;
-    pixel *sample_img2;
+    const char   *path;
+    FILE         *f;
+    PartialHeader hdr;
+    char         *names[MAX_DIST];
+} PartialFile;
 
-    if (scale < 1 || scale > 5) 
+static int open_partial(PartialFile *p, const char *path)
+{
+    memset(p, 0, sizeof(*p));
+    p->path = path;
+    p->f = fopen(path, "rb");
+    if (!p->f || fread(&p->hdr, sizeof(p->hdr), 1, p->f) != 1 || memcmp(p->hdr.magic, PARTIAL_MAGIC, sizeof(p->hdr.magic)) ||
+        p->hdr.nb_dist < 1 || p->hdr.nb_dist > MAX_DIST || p->hdr.frames < 0)
+        return -1;
+    for (int k = 0; k < p->hdr.nb_dist; k++)
     {
-        scale = 5;
+        int32_t len;
+        if (fread(&len, sizeof(len), 1, p->f) != 1 || len < 0 || len > 4096 || !(p->names[k] = (char *)calloc(len + 1, 1)) ||
+            fread(p->names[k], 1, len, p->f) != (size_t)len)
+            return -1;
     }
+    return 0;
+}
+
+static void close_partial(PartialFile *p)
+{
+    if (p->f)
+        fclose(p->f);
+    for (int k = 0; k < MAX_DIST; k++)
+        free(p->names[k]);
+}
 
-    temp        = (int *)malloc((2*w+12)*sizeof(*temp));
-    ori_img1    = (pixel*)malloc(w * h * sizeof(pixel));
-    ori_img2    = (pixel*)malloc(w * h * sizeof(pixel));
-    sample_img1 = (pixel*)malloc(w * h * sizeof(pixel));
-    sample_img2 = (pixel*)malloc(w * h * sizeof(pixel));
+/*
+ * ms-ssim merge <partial>...：分片按起始帧号排序后必须首尾相接，参数必须相同，
+ * 按帧的顺序重新累加，输出与一次算完时相同的Total行。
+ */
+static int merge_partials(int nb_paths, char **paths)
+{
+    std::vector<PartialFile> parts(nb_paths);
+    float ms_ssim[MAX_DIST][3] = {};
+    PlaneMetrics metrics[MAX_DIST][3] = {};
+    float frame_ms_ssim[MAX_DIST][3];
+    PlaneMetrics frame_metrics[MAX_DIST][3];
+    int frames = 0;
+    int ret = 0;
 
-    for (int i = 0; i < w * h; i++) 
+    if (nb_paths < 1)
     {
-        ori_img1[i] = pix1[i];
-        ori_img2[i] = pix2[i];
+        printf("ms-ssim merge <partial> [<partial> ...]\n");
+        return -1;
     }
 
-    // 计算每个尺度的ssim值.
-    for (int i = 1; i <= scale; i++) 
+    for (int i = 0; i < nb_paths && !ret; i++)
     {
-        if (i != 1) 
+        if (open_partial(&parts[i], paths[i]) < 0)
         {
-            memset(sample_img1, 0, width * height);
-            memset(sample_img2, 0, width * height);
+            fprintf(stderr, "%s is not a complete partial result file\n", paths[i]);
+            ret = -1;
+        }
+    }
+    if (!ret)
+    {
+        std::sort(parts.begin(), parts.end(), [](const PartialFile &a, const PartialFile &b) { return a.hdr.start < b.hdr.start; });
+    }
 
-            downsample_2x2_mean(ori_img1, w, h, sample_img1);
-            downsample_2x2_mean(ori_img2, w, h, sample_img2);
+    for (int i = 0; i < nb_paths && !ret; i++)
+    {
+        const PartialHeader *hdr = &parts[i].hdr, *first = &parts[0].hdr;
+        float sum_ms_ssim[MAX_DIST][3] = {};
+        PlaneMetrics sum_metrics[MAX_DIST][3] = {};
 
-            w = w >> 1;
-            h = h >> 1;
+        if (hdr->width != first->width || hdr->height != first->height || hdr->bit_depth != first->bit_depth ||
+            hdr->window != first->window || hdr->fast_end != first->fast_end || hdr->nb_dist != first->nb_dist || hdr->all_metrics != first->all_metrics)
+        {
+            fprintf(stderr, "%s was computed with different parameters than %s\n", parts[i].path, parts[0].path);
+            ret = -1;
+            break;
+        }
+        if (hdr->start != first->start + frames)
+        {
+            fprintf(stderr, "%s starts at frame %d, expected %d\n", parts[i].path, hdr->start, first->start + frames);
+            ret = -1;
+            break;
+        }
 
-            memset(ori_img1, 0, width * height);
-            memset(ori_img2, 0, width * height);
+        // 与output_frame()相同的顺序累加
+        for (int n = 0; n < hdr->frames && !ret; n++)
+        {
+            if (read_partial_record(parts[i].f, hdr->nb_dist, hdr->all_metrics, frame_ms_ssim, frame_metrics) < 0)
+            {
+                ret = -1;
+                break;
+            }
+            for (int k = 0; k < hdr->nb_dist; k++)
+            {
+                for (int j = 0; j < 3; j++)
+                {
+                    ms_ssim[k][j]          += frame_ms_ssim[k][j];
+                    sum_ms_ssim[k][j]      += frame_ms_ssim[k][j];
+                    metrics[k][j].sse      += frame_metrics[k][j].sse;
+                    metrics[k][j].ssim     += frame_metrics[k][j].ssim;
+                    sum_metrics[k][j].sse  += frame_metrics[k][j].sse;
+                    sum_metrics[k][j].ssim += frame_metrics[k][j].ssim;
+                }
+            }
+        }
 
-            for (int j = 0; j < w * h; j++) 
+        // 分片自己的和应该与重新累加的结果逐位一致
+        if (!ret && read_partial_record(parts[i].f, hdr->nb_dist, hdr->all_metrics, frame_ms_ssim, frame_metrics) < 0)
+            ret = -1;
+        for (int k = 0; k < hdr->nb_dist && !ret; k++)
+        {
+            for (int j = 0; j < 3; j++)
             {
-                ori_img1[j] = sample_img1[j];
-                ori_img2[j] = sample_img2[j];
+                if (memcmp(&frame_ms_ssim[k][j], &sum_ms_ssim[k][j], sizeof(float)) ||
+                    (hdr->all_metrics && (frame_metrics[k][j].sse != sum_metrics[k][j].sse ||
+                                          memcmp(&frame_metrics[k][j].ssim, &sum_metrics[k][j].ssim, sizeof(float)))))
+                    ret = -1;
             }
         }
+        if (ret)
+            fprintf(stderr, "%s is truncated or corrupt\n", parts[i].path);
+        frames += hdr->frames;
+    }
 
-        value = ssim_plane(ori_img1, w, ori_img2, w, w, h, temp, NULL);
-        result *= pow(value.C_S, WEIGHT[i-1]);
-        luminance_value[i-1] = value.L;
+    if (!ret && frames)
+    {
+        print_totals(stdout, ms_ssim, metrics, parts[0].hdr.nb_dist, parts[0].names, frames,
+                     parts[0].hdr.width, parts[0].hdr.height, parts[0].hdr.bit_depth, parts[0].hdr.all_metrics);
     }
 
-    free(temp);
-    free(ori_img1);
-    free(ori_img2);
-    free(sample_img1);
-    free(sample_img2);
-    temp = NULL;
-    ori_img1 = NULL;
-    ori_img2 = NULL;
-    sample_img1 = NULL;
-    sample_img2 = NULL;
+    for (int i = 0; i < nb_paths; i++)
+        close_partial(&parts[i]);
+    return ret;
+}
+
+static void stage_name(int stage, char *name, size_t size)
+{
+    static const char *const names[] = {"build_ref", "read", "hash", "score", "output"};
+
+    if (stage < STAGE_DOWNSAMPLE)
+        snprintf(name, size, "ssim_scale%d", stage - STAGE_SSIM + 1);
+    else if (stage < STAGE_BUILD_REF)
+        snprintf(name, size, "downsample_scale%d", stage - STAGE_DOWNSAMPLE + 1);
+    else
+        snprintf(name, size, "%s", names[stage - STAGE_BUILD_REF]);
+}
+
+// 每帧耗时的第p分位(最近秩)，ns已排序
+static double percentile_ms(const std::vector<int64_t> &ns, double p)
+{
+    size_t i = (size_t)ceil(p * ns.size());
+    return ns[i ? i - 1 : 0] / 1e6;
+}
+
+/*
+ * 输出--stats的统计：每个阶段的总耗时、调用次数、每帧的平均和p50/p99。
+ * 核心的阶段和score在多线程时是各工作线程的和，可能超过墙上时间。
+ * json不为NULL时写成JSON，否则打印到stderr。
+ */
+static int print_stats(RunStats *stats, int frames, int threads, const char *json)
+{
+    double wall = seconds_since(stats->start);
+    FILE *f = stderr;
+
+    if (json && !(f = fopen(json, "w")))
+        return -1;
+
+    if (json)
+        fprintf(f, "{\n  \"frames\": %d,\n  \"threads\": %d,\n  \"wall_s\": %.6f,\n  \"stages\": {", frames, threads, wall);
+    else
+        fprintf(f, "Stats: %d frames in %.3fs%s\n%-20s %10s %8s %12s %10s %10s\n", frames, wall,
+                threads > 1 ? " (stage times summed over threads)" : "",
+                "stage", "total(s)", "calls", "mean(ms)", "p50(ms)", "p99(ms)");
 
-    result *= pow(luminance_value[scale-1], WEIGHT[scale-1]);
-    return result;
+    int first = 1;
+    for (int s = 0; s < NB_STAGES; s++)
+    {
+        std::vector<int64_t> &ns = stats->frame_ns[s];
+        if (!stats->count[s] || ns.empty())
+            continue;
+
+        char name[32];
+        int64_t total = 0;
+        for (int64_t v : ns)
+            total += v;
+        std::sort(ns.begin(), ns.end());
+        stage_name(s, name, sizeof(name));
+
+        double mean = total / 1e6 / ns.size();
+        double p50 = percentile_ms(ns, 0.50);
+        double p99 = percentile_ms(ns, 0.99);
+        if (json)
+            fprintf(f, "%s\n    \"%s\": {\"total_s\": %.6f, \"calls\": %" PRIu64 ", \"mean_ms\": %.6f, \"p50_ms\": %.6f, \"p99_ms\": %.6f}",
+                    first ? "" : ",", name, total / 1e9, stats->count[s], mean, p50, p99);
+        else
+            fprintf(f, "%-20s %10.3f %8" PRIu64 " %12.3f %10.3f %10.3f\n", name, total / 1e9, stats->count[s], mean, p50, p99);
+        first = 0;
+    }
+
+    if (json)
+    {
+        fprintf(f, "\n  }\n}\n");
+        if (fclose(f))
+            return -1;
+    }
+    return 0;
 }
 
 int main(int argc, char *argv[])
 {
-    FILE *f[2];
-    uint8_t *buf[2], *plane[2][3];
+    FrameSource src[MAX_DIST + 1];
+    const char *args[MAX_DIST + 3];
+    int nb_args = 0;
+    int too_many_args = 0;
+    int nb_files;
     int *temp;
-    float ms_ssim[3] = {0, 0, 0};
-    int frame_size, w, h;
-    int frames, seek;
+    MSSSIMContext ctx;
+    FramePool pool;
+    float ms_ssim[MAX_DIST][3] = {};
+    PlaneMetrics metrics[MAX_DIST][3] = {};
+    int frame_size, w = 0, h = 0;
+    int frames, seek = 0;
+    int has_size = 0;
+    int threads = 1;
+    int band_threads = 1;
+    int use_mmap = 1;
+    int bit_depth = 0; // 0表示没有指定，Y4M按文件头，否则为8
+    int window = WINDOW_BLOCK;
+    int all_metrics = 0;
+    int async_read = 0;
+    int tiled = 0;
+    int fast_end = 0;
+    int dedup = 0;
+    int first_frame = 0;
+    int max_frames = 0;
+    const char *partial = NULL;
+    int stats = 0;
+    const char *stats_json = NULL;
+    int format = FORMAT_TEXT;
+    int subsample = 1;
+    int stratified = 0;
+    uint64_t seed = 1;
+    const char *output = NULL;
+    ResultSink sink;
+    RunStats run_stats;
+    int printed = 0;
     int i;
 
-    // 输入格式
-    if (argc < 4 || 2 != sscanf(argv[3], "%dx%d", &w, &h))
+    if (argc > 1 && !strcmp(argv[1], "merge"))
+        return merge_partials(argc - 2, argv + 2);
+
+    for (i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--band-threads") && i + 1 < argc)
+            band_threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--bitdepth") && i + 1 < argc)
+            bit_depth = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--window") && i + 1 < argc)
+        {
+            i++;
+            window = !strcmp(argv[i], "gaussian") ? WINDOW_GAUSSIAN : !strcmp(argv[i], "block") ? WINDOW_BLOCK : -1;
+        }
+        else if (!strcmp(argv[i], "--no-mmap"))
+            use_mmap = 0;
+        else if (!strcmp(argv[i], "--all-metrics"))
+            all_metrics = 1;
+        else if (!strcmp(argv[i], "--async-read"))
+            async_read = 1;
+        else if (!strcmp(argv[i], "--tiled"))
+            tiled = 1;
+        else if (!strcmp(argv[i], "--fast-end"))
+            fast_end = 1;
+        else if (!strcmp(argv[i], "--dedup"))
+            dedup = 1;
+        else if (!strcmp(argv[i], "--frames") && i + 1 < argc)
+        {
+            // start:count，count省略或为0时算到结束
+            if (sscanf(argv[++i], "%d:%d", &first_frame, &max_frames) < 1)
+                first_frame = -1;
+        }
+        else if (!strcmp(argv[i], "--partial") && i + 1 < argc)
+            partial = argv[++i];
+        else if (!strcmp(argv[i], "--format") && i + 1 < argc)
+        {
+            i++;
+            format = !strcmp(argv[i], "text") ? FORMAT_TEXT : !strcmp(argv[i], "csv") ? FORMAT_CSV :
+                     !strcmp(argv[i], "jsonl") ? FORMAT_JSONL : !strcmp(argv[i], "bin") ? FORMAT_BIN : -1;
+        }
+        else if (!strcmp(argv[i], "--output") && i + 1 < argc)
+            output = argv[++i];
+        else if (!strcmp(argv[i], "--subsample") && i + 1 < argc)
+            subsample = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--stratified"))
+            stratified = 1;
+        else if (!strcmp(argv[i], "--seed") && i + 1 < argc)
+            seed = strtoull(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "--stats"))
+            stats = 1;
+        else if (!strcmp(argv[i], "--stats-json") && i + 1 < argc)
+        {
+            stats = 1;
+            stats_json = argv[++i];
+        }
+        else if (nb_args < MAX_DIST + 3)
+            args[nb_args++] = argv[i];
+        else
+            too_many_args = 1;
+    }
+
+    // 输入格式：参考文件，一个或多个失真文件，然后是<width>x<height>(Y4M可以省略)，最后是可选的seek
+    for (nb_files = 2; nb_files < nb_args; nb_files++)
+    {
+        int tw, th;
+        if (2 == sscanf(args[nb_files], "%dx%d", &tw, &th))
+        {
+            w = tw;
+            h = th;
+            has_size = 1;
+            break;
+        }
+        // 最后一个参数是数字(可以带负号)时是seek，单独的"-"是stdin
+        const char *arg = args[nb_files] + (args[nb_files][0] == '-');
+        if (nb_files == nb_args - 1 && arg[0] >= '0' && arg[0] <= '9' && strspn(arg, "0123456789") == strlen(arg))
+            break;
+    }
+    i = nb_files + has_size;
+    if (i < nb_args)
+        seek = atoi(args[i++]);
+    if (nb_args < 2 || i < nb_args || too_many_args || nb_files - 1 > MAX_DIST || threads < 1 || band_threads < 1 ||
+        (bit_depth && bit_depth != 8 && bit_depth != 10 && bit_depth != 12 && bit_depth != 16) || window < 0 ||
+        (tiled && (window != WINDOW_BLOCK || band_threads > 1)) || (fast_end && window != WINDOW_BLOCK) ||
+        first_frame < 0 || max_frames < 0 || format < 0 || subsample < 1 || (subsample > 1 && partial))
     {
-        printf("ms-ssim <file1.yuv> <file2.yuv> <width>x<height> [<seek>]\n");
+        printf("ms-ssim <ref> <dist> [<dist2> ...] [<width>x<height>] [<seek>] [--bitdepth 8|10|12|16]\n"
+               "        [--window block|gaussian] [--threads N] [--band-threads N] [--no-mmap] [--all-metrics]\n"
+               "        [--async-read] [--tiled] [--fast-end] [--dedup] [--frames <start>:<count>] [--partial <file>]\n"
+               "        [--stats] [--stats-json <file>] [--format text|csv|jsonl|bin] [--output <file>]\n"
+               "        [--subsample N [--stratified] [--seed S]]\n"
+               "ms-ssim merge <partial> [<partial> ...]\n"
+               "inputs are raw .yuv or Y4M files, at most %d distorted, '-' reads stdin; <width>x<height> is optional for Y4M\n",
+               MAX_DIST);
         return -1;
     }
+    pool.nb_dist = nb_files - 1;
 
-    // 读入两个文件 长x宽
-    f[0] = fopen(argv[1], "rb");
-    f[1] = fopen(argv[2], "rb");
-    sscanf(argv[3], "%dx%d", &w, &h);
+    // 打开所有文件，尺寸和位深未知时由第一个Y4M文件头确定。
+    // seek为正时跳过参考文件开头的seek字节，为负时跳过每个失真文件的
+    for (i = 0; i < nb_files; i++)
+    {
+        if (frame_source_open(&src[i], args[i], &w, &h, &bit_depth, (i > 0) == (seek < 0) ? labs(seek) : 0, use_mmap) < 0)
+        {
+            fprintf(stderr, "Failed to open %s\n", args[i]);
+            return -1;
+        }
+        frame_source_skip_frames(&src[i], first_frame);
+    }
 
     if (w <= 0 || h <= 0 || w * (int64_t)h >= INT_MAX / 3 || 2LL * w + 12 >= INT_MAX / sizeof(*temp))
     {
@@ -309,51 +1970,223 @@ int main(int argc, char *argv[])
         return -2;
     }
 
+    // 高斯窗口在最小的尺度(色度平面下采样4次)上也要放得下
+    if (window == WINDOW_GAUSSIAN && ((w >> 1) >> (MAX_SCALE - 1) < GAUSS_TAPS || (h >> 1) >> (MAX_SCALE - 1) < GAUSS_TAPS))
+    {
+        fprintf(stderr, "Dimensions are too small for the %dx%d gaussian window at %d scales\n", GAUSS_TAPS, GAUSS_TAPS, MAX_SCALE);
+        return -2;
+    }
+
     // 一帧的内存大小
     // yuv420格式：先w*h个Y，然后1/4*w*h个U，再然后1/4*w*h个
-    frame_size = w * h * 3LL / 2;
+    // 位深大于8时每个采样占两个字节(小端)
+    frame_size = w * h * 3LL / 2 * (bit_depth > 8 ? 2 : 1);
+
+    // 单线程时只有一个缓存(单独的读线程时两个)，多线程时每个线程两个，保证读文件的时候所有线程都有帧可以算
+    pool.nb_jobs   = threads > 1 ? 2 * threads : async_read ? 2 : 1;
+    pool.jobs      = (FrameJob *)calloc(pool.nb_jobs, sizeof(FrameJob));
+    pool.submitted = 0;
+    pool.next      = 0;
+    pool.quit      = 0;
+    pool.src       = src;
+    pool.nb_files  = nb_files;
+    pool.output    = 0;
+    pool.read_eof  = 0;
+    pool.read_time = 0;
+    pool.producer_stall = 0;
+    pool.consumer_stall = 0;
+    pool.w         = w;
+    pool.h         = h;
+    pool.band_threads = band_threads;
+    pool.bit_depth = bit_depth;
+    pool.window = window;
+    pool.tiled = tiled;
+    pool.fast_end = fast_end;
+    pool.all_metrics = all_metrics;
+    pool.dedup = dedup;
+    pool.have_last = 0;
+    pool.dup_frames = 0;
+    pool.identical_planes = 0;
+    pool.first_frame = first_frame;
+    pool.max_frames = max_frames;
+    pool.partial = NULL;
+    pool.subsample  = subsample;
+    pool.stratified = stratified;
+    pool.rng = seed;
+    pool.pos = 0;
+    memset(&pool.spare, 0, sizeof(pool.spare));
+    memset(pool.sample_sum, 0, sizeof(pool.sample_sum));
+    memset(pool.sample_sq, 0, sizeof(pool.sample_sq));
+    pool.stats = NULL;
+    pool.sink = &sink;
+    if (open_sink(&sink, output, format, pool.nb_dist, all_metrics) < 0)
+    {
+        fprintf(stderr, "Failed to create %s\n", output ? output : "the output buffer");
+        return -1;
+    }
+    if (stats)
+    {
+        memset(run_stats.count, 0, sizeof(run_stats.count));
+        pool.stats = &run_stats;
+    }
+    if (partial && start_partial(&pool, partial, args + 1) < 0)
+    {
+        fprintf(stderr, "Failed to create %s\n", partial);
+        return -1;
+    }
 
-    // plane[i][0] Y分量信息
-    // plane[i][1] U分量信息
-    // plane[i][2] V分量信息
-    for (i = 0; i < 2; i++)
+    // planes[i].data[0] Y分量信息
+    // planes[i].data[1] U分量信息
+    // planes[i].data[2] V分量信息
+    for (int j = 0; j < pool.nb_jobs; j++)
+    {
+        FrameJob *job = &pool.jobs[j];
+        for (i = 0; i < nb_files; i++)
+        {
+            if (src[i].f && !src[i].map)
+                job->buf[i] = (uint8_t *)malloc(frame_size + PIXEL_PADDING);
+        }
+    }
+    for (i = 0; stratified && i < nb_files; i++)
     {
-        buf[i] = (uint8_t *)malloc(frame_size);
-        plane[i][0] = buf[i]; // plane[i][0] = buf[i]
-        plane[i][1] = plane[i][0] + w * h;
-        plane[i][2] = plane[i][1] + w * h / 4;
+        if (src[i].f && !src[i].map)
+            pool.spare.buf[i] = (uint8_t *)malloc(frame_size + PIXEL_PADDING);
     }
 
-    seek = argc < 5 ? 0 : atoi(argv[4]);
-    fseek(f[seek < 0], seek < 0 ? -seek : seek, SEEK_SET);
+    if (threads > 1)
+    {
+        for (i = 0; i < threads; i++)
+            pool.workers.emplace_back(frame_worker, &pool);
+    }
+    else if (ms_ssim_init(&ctx, w, h, bit_depth, window, band_threads, pool.nb_dist > 1, tiled, fast_end) < 0)
+    {
+        fprintf(stderr, "Failed to allocate MS-SSIM context\n");
+        return -3;
+    }
 
     // 逐帧计算
-    for (frames = 0;; frames++)
+    run_stats.start = Clock::now();
+    if (async_read)
     {
-        float ms_ssim_one[3]; // Y U V 三个向量一帧ms-ssim的结果
-        // 分别读入这一帧Y向量的地址，随之也获得了UV向量的起始地址
-        if (fread(buf[0], frame_size, 1, f[0]) != 1)
-            break;
-        if (fread(buf[1], frame_size, 1, f[1]) != 1)
-            break;
-        for (int i = 0; i < 3; i++)
+        // 读线程负责读入(多线程时也由它提交给工作线程)，这里只按顺序计算和输出
+        std::thread reader(frame_reader, &pool);
+        for (frames = 0; !wait_frame(&pool, frames); frames++)
+        {
+            if (threads == 1)
+                score_frame(&ctx, &pool, &pool.jobs[frames % pool.nb_jobs]);
+            output_frame(&pool, printed++, ms_ssim, metrics, w, h);
+        }
+        reader.join();
+    }
+    else
+    {
+        for (frames = 0;; frames++)
+        {
+            FrameJob *job = &pool.jobs[frames % pool.nb_jobs];
+
+            // 缓存复用之前，先按顺序输出占用它的那一帧
+            if (frames >= pool.nb_jobs)
+                output_frame(&pool, printed++, ms_ssim, metrics, w, h);
+
+            // 分别读入这一帧Y、U、V平面的地址和跨度，任何一个文件读完或者够了--frames的帧数就结束
+            int64_t t = pool.stats ? stats_clock() : 0;
+            if (read_sample(&pool, src, nb_files, job, frames) < 0)
+                break;
+            if (pool.stats)
+                job->read_ns = stats_clock() - t;
+            if (pool.dedup)
+            {
+                t = pool.stats ? stats_clock() : 0;
+                hash_frame(&pool, job);
+                if (pool.stats)
+                    job->hash_ns = stats_clock() - t;
+            }
+
+            if (threads > 1)
+                submit_frame(&pool, job);
+            else
+                score_frame(&ctx, &pool, job);
+        }
+
+        // 输出还没有输出的帧
+        while (printed < frames)
+            output_frame(&pool, printed++, ms_ssim, metrics, w, h);
+    }
+
+    if (threads > 1)
+    {
+        {
+            std::lock_guard<std::mutex> lock(pool.mutex);
+            pool.quit = 1;
+        }
+        pool.job_cond.notify_all();
+        for (auto &worker : pool.workers)
+            worker.join();
+    }
+    else
+    {
+        ms_ssim_uninit(&ctx);
+    }
+
+    for (int j = 0; j < pool.nb_jobs; j++)
+    {
+        for (i = 0; i < nb_files; i++)
         {
-            ms_ssim_one[i] = ms_ssim_plane(plane[0][i], plane[1][i], w >> !!i, h >> !!i);
-            ms_ssim[i] += ms_ssim_one[i];
+            free(pool.jobs[j].buf[i]);
+#if CONFIG_AVFORMAT
+            av_frame_free(&pool.jobs[j].planes[i].frame);
+#endif
         }
+    }
+    for (i = 0; i < nb_files; i++)
+    {
+        free(pool.spare.buf[i]);
+#if CONFIG_AVFORMAT
+        av_frame_free(&pool.spare.planes[i].frame);
+#endif
+    }
+    free(pool.jobs);
+    for (i = 0; i < nb_files; i++)
+        frame_source_close(&src[i]);
+
+    if (async_read)
+    {
+        fprintf(stderr, "Reader: %.3fs reading, %.3fs waiting for free buffers | Scorer: %.3fs waiting for input%s\n",
+                pool.read_time, pool.producer_stall, pool.consumer_stall, threads > 1 ? " (sum over threads)" : "");
+    }
+
+    if (dedup)
+    {
+        fprintf(stderr, "Dedup: %d of %d frames repeated the previous frame and were not scored, "
+                        "%d planes were identical to the reference\n", pool.dup_frames, frames, pool.identical_planes);
+    }
+
+    // 先把缓冲里的结果写出去，Total行在它们后面
+    if (close_sink(&sink) < 0)
+    {
+        fprintf(stderr, "Failed to write %s\n", output ? output : "the results");
+        return -4;
+    }
+
+    if (pool.stats && print_stats(pool.stats, frames, threads, stats_json) < 0)
+    {
+        fprintf(stderr, "Failed to write %s\n", stats_json);
+        return -4;
+    }
 
-        printf("Frame %d | ", frames);
-        print_results(ms_ssim_one, 1, w, h);
-        printf("                \r");
-        fflush(stdout);
+    if (pool.partial && finish_partial(&pool, frames, ms_ssim, metrics) < 0)
+    {
+        fprintf(stderr, "Failed to write %s\n", partial);
+        return -4;
     }
 
     if (!frames)
         return 0;
 
-    printf("Total %d frames | ", frames);
-    print_results(ms_ssim, frames, w, h);
-    printf("\n");
-
+    // 结构化的结果写到stdout时，Total行改写到stderr，不混进要解析的输出
+    FILE *totals = format != FORMAT_TEXT && !output ? stderr : stdout;
+    print_totals(totals, ms_ssim, metrics, pool.nb_dist, args + 1, frames, w, h, bit_depth, all_metrics);
+    if (subsample > 1)
+        print_confidence(totals, &pool, args + 1, frames);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,261 @@
+/*
+ * bench_vif.cpp
+ * Google Benchmark microbenchmarks for the native VIF engine (vif_core.h),
+ * against libvmaf's integer vif on the same planes. Each is timed over a
+ * resolution sweep (360p to 4K) of synthetic 8-bit content and reported in
+ * (luma) pixels per second:
+ *
+ *   vif_vfilter        the vertical filter over every row of a plane
+ *   vif_hfilter        the horizontal filter over every row of a plane
+ *   vif_stat           the per-pixel statistics and logs over a plane
+ *   vif_plane_native   the whole 4-scale VIF of a plane
+ *   vif_plane_libvmaf  the same with libvmaf, on a single-threaded context
+ *
+ * The kernel benchmarks run scale 0 (17 taps) and scale 1 (9 taps), which
+ * are most of the work. The libvmaf one includes allocating the two
+ * pictures and copying the plane into them, as vif_plane_native includes
+ * loading the plane into its buffers. The kernels run through the same
+ * runtime dispatch as test_vif; build with -DVIF_NO_SIMD to benchmark the
+ * C versions.
+ *
+ * g++ -O2 -pthread -o bench_vif bench_vif.cpp -lbenchmark -lvmaf
+ * ./bench_vif --benchmark_filter=vif_plane
+ */
+#include <benchmark/benchmark.h>
+#include <vector>
+
+extern "C" {
+    #include "libvmaf/picture.h"
+    #include "libvmaf/libvmaf.h"
+}
+
+#include "vif_core.h"
+
+static const int RESOLUTIONS[][2] = {
+    {640, 360}, {1280, 720}, {1920, 1080}, {3840, 2160},
+};
+
+/*
+ * Sine texture plus noise for the reference, and the reference plus a little
+ * more noise for the distorted plane, so the statistics take the usual
+ * branches. Fixed seed, the same planes every run.
+ */
+struct SyntheticPlane {
+    int width;
+    int height;
+    std::vector<uint8_t> ref;
+    std::vector<uint8_t> dis;
+
+    SyntheticPlane(int w, int h) : width(w), height(h), ref((size_t)w * h), dis((size_t)w * h) {
+        uint32_t seed = 1;
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                seed = seed * 1664525 + 1013904223;
+                double v = 255 * (0.5 + 0.23 * sin(x * 0.05) * cos(y * 0.07)) + (int)(seed >> 24) % 40 - 20;
+                int a = v < 0 ? 0 : v > 255 ? 255 : (int)v;
+                int b = a + (int)(seed >> 16 & 0xff) % 21 - 10;
+                ref[(size_t)y * w + x] = a;
+                dis[(size_t)y * w + x] = b < 0 ? 0 : b > 255 ? 255 : b;
+            }
+        }
+    }
+};
+
+static void set_pixels(benchmark::State &state, int width, int height) {
+    state.SetItemsProcessed(state.iterations() * (int64_t)width * height);
+    state.SetLabel(std::to_string(width) + "x" + std::to_string(height) + " pixels");
+}
+
+// a context with the plane scored once, so every scale's planes are loaded
+static int load_plane(VIFContext *ctx, const SyntheticPlane &plane) {
+    VifScore score;
+
+    if (vif_init(ctx, plane.width, plane.height))
+        return -1;
+    if (vif_plane(ctx, plane.ref.data(), plane.width, plane.dis.data(), plane.width,
+                  plane.width, plane.height, 8, &score)) {
+        vif_uninit(ctx);
+        return -1;
+    }
+    return 0;
+}
+
+// the vertical moments of the middle row of a scale into ctx->vbuf, padded, in pointing at them
+static void vfilter_middle_row(VIFContext *ctx, int scale, const uint32_t *in[5]) {
+    int w = ctx->width >> scale, h = ctx->height >> scale;
+    int taps = vif_filter_taps[scale];
+    const uint16_t *ref[VIF_MAX_TAPS], *dis[VIF_MAX_TAPS];
+    uint32_t *vrow[5];
+
+    for (int k = 0; k < taps; k++) {
+        ref[k] = ctx->ref[scale] + (size_t)(h / 2 - taps / 2 + k) * w;
+        dis[k] = ctx->dis[scale] + (size_t)(h / 2 - taps / 2 + k) * w;
+    }
+    for (int i = 0; i < 5; i++) {
+        vrow[i] = ctx->vbuf[i] + VIF_PAD;
+        in[i] = vrow[i] - taps / 2;
+    }
+    vif_dsp().vfilter(ref, dis, vif_filter[scale], taps, w, vrow);
+    for (int i = 0; i < 5; i++)
+        vif_pad_row(vrow[i], w, taps / 2);
+}
+
+template <int scale>
+static void BM_vif_vfilter(benchmark::State &state) {
+    const VifDSPContext &dsp = vif_dsp();
+    SyntheticPlane plane(state.range(0), state.range(1));
+    VIFContext ctx;
+    int w = plane.width >> scale, h = plane.height >> scale;
+    int taps = vif_filter_taps[scale];
+    uint32_t *out[5];
+
+    if (load_plane(&ctx, plane)) {
+        state.SkipWithError("Failed to set up the VIF context");
+        return;
+    }
+    for (int i = 0; i < 5; i++)
+        out[i] = ctx.vbuf[i] + VIF_PAD;
+
+    for (auto _ : state) {
+        for (int y = 0; y < h; y++) {
+            const uint16_t *ref[VIF_MAX_TAPS], *dis[VIF_MAX_TAPS];
+            for (int k = 0; k < taps; k++) {
+                size_t row = (size_t)vif_mirror(y - taps / 2 + k, h) * w;
+                ref[k] = ctx.ref[scale] + row;
+                dis[k] = ctx.dis[scale] + row;
+            }
+            dsp.vfilter(ref, dis, vif_filter[scale], taps, w, out);
+        }
+        benchmark::ClobberMemory();
+    }
+    vif_uninit(&ctx);
+    set_pixels(state, w, h);
+}
+
+// only the horizontal filter: every row filters the same vertical moments
+template <int scale>
+static void BM_vif_hfilter(benchmark::State &state) {
+    const VifDSPContext &dsp = vif_dsp();
+    SyntheticPlane plane(state.range(0), state.range(1));
+    VIFContext ctx;
+    int w = plane.width >> scale, h = plane.height >> scale;
+    int taps = vif_filter_taps[scale];
+    const uint32_t *in[5];
+
+    if (load_plane(&ctx, plane)) {
+        state.SkipWithError("Failed to set up the VIF context");
+        return;
+    }
+    vfilter_middle_row(&ctx, scale, in);
+
+    for (auto _ : state) {
+        for (int y = 0; y < h; y++)
+            dsp.hfilter(in, vif_filter[scale], taps, w, ctx.hbuf);
+        benchmark::ClobberMemory();
+    }
+    vif_uninit(&ctx);
+    set_pixels(state, w, h);
+}
+
+// only the statistics: every row is the same filtered moments
+template <int scale>
+static void BM_vif_stat(benchmark::State &state) {
+    const VifDSPContext &dsp = vif_dsp();
+    SyntheticPlane plane(state.range(0), state.range(1));
+    VIFContext ctx;
+    int w = plane.width >> scale, h = plane.height >> scale;
+    int taps = vif_filter_taps[scale];
+    const uint32_t *in[5];
+
+    if (load_plane(&ctx, plane)) {
+        state.SkipWithError("Failed to set up the VIF context");
+        return;
+    }
+    vfilter_middle_row(&ctx, scale, in);
+    dsp.hfilter(in, vif_filter[scale], taps, w, ctx.hbuf);
+
+    for (auto _ : state) {
+        VifAccum acc;
+        memset(&acc, 0, sizeof(acc));
+        for (int y = 0; y < h; y++)
+            dsp.stat(ctx.hbuf, w, ctx.gain_limit, &acc);
+        benchmark::DoNotOptimize(acc);
+    }
+    vif_uninit(&ctx);
+    set_pixels(state, w, h);
+}
+
+static void BM_vif_plane_native(benchmark::State &state) {
+    SyntheticPlane plane(state.range(0), state.range(1));
+    VIFContext ctx;
+
+    if (vif_init(&ctx, plane.width, plane.height)) {
+        state.SkipWithError("Failed to allocate VIF context");
+        return;
+    }
+    for (auto _ : state) {
+        VifScore score;
+        vif_plane(&ctx, plane.ref.data(), plane.width, plane.dis.data(), plane.width,
+                  plane.width, plane.height, 8, &score);
+        benchmark::DoNotOptimize(score);
+    }
+    vif_uninit(&ctx);
+    set_pixels(state, plane.width, plane.height);
+}
+
+// with n_threads 0, vmaf_read_pictures extracts vif in this thread before returning
+static void BM_vif_plane_libvmaf(benchmark::State &state) {
+    SyntheticPlane plane(state.range(0), state.range(1));
+    VmafConfiguration cfg = {
+        .log_level = VMAF_LOG_LEVEL_WARNING,
+        .n_threads = 0,
+        .n_subsample = 1
+    };
+    VmafContext *vmaf;
+    unsigned index = 0;
+
+    if (vmaf_init(&vmaf, cfg) || vmaf_use_feature(vmaf, "vif", NULL)) {
+        state.SkipWithError("Failed to set up the libvmaf context");
+        return;
+    }
+    for (auto _ : state) {
+        VmafPicture pic[2];
+        const std::vector<uint8_t> *src[2] = {&plane.ref, &plane.dis};
+        for (int i = 0; i < 2; i++) {
+            if (vmaf_picture_alloc(&pic[i], VMAF_PIX_FMT_YUV420P, 8, plane.width, plane.height)) {
+                if (i)
+                    vmaf_picture_unref(&pic[0]);
+                state.SkipWithError("vmaf_picture_alloc failed");
+                break;
+            }
+            for (int y = 0; y < plane.height; y++)
+                memcpy((uint8_t *)pic[i].data[0] + y * pic[i].stride[0], src[i]->data() + (size_t)y * plane.width, plane.width);
+        }
+        if (state.error_occurred())
+            break;
+        if (vmaf_read_pictures(vmaf, &pic[0], &pic[1], index++)) {
+            state.SkipWithError("vmaf_read_pictures failed");
+            break;
+        }
+    }
+    vmaf_read_pictures(vmaf, NULL, NULL, 0);
+    vmaf_close(vmaf);
+    set_pixels(state, plane.width, plane.height);
+}
+
+static void resolutions(benchmark::internal::Benchmark *b) {
+    b->ArgNames({"w", "h"});
+    for (auto &r : RESOLUTIONS)
+        b->Args({r[0], r[1]});
+}
+
+BENCHMARK_TEMPLATE(BM_vif_vfilter, 0)->Apply(resolutions);
+BENCHMARK_TEMPLATE(BM_vif_vfilter, 1)->Apply(resolutions);
+BENCHMARK_TEMPLATE(BM_vif_hfilter, 0)->Apply(resolutions);
+BENCHMARK_TEMPLATE(BM_vif_hfilter, 1)->Apply(resolutions);
+BENCHMARK_TEMPLATE(BM_vif_stat, 0)->Apply(resolutions);
+BENCHMARK_TEMPLATE(BM_vif_stat, 1)->Apply(resolutions);
+BENCHMARK(BM_vif_plane_native)->Apply(resolutions);
+BENCHMARK(BM_vif_plane_libvmaf)->Apply(resolutions);
+
+BENCHMARK_MAIN();
@@ -3,125 +3,1173 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 extern "C" {
     #include "libvmaf/picture.h"
     #include "libvmaf/libvmaf.h"
 }
 
-static void copy_data(uint8_t *src, VmafPicture *dst, unsigned width,
-                      unsigned height, int src_stride)
-{
-    uint8_t *a = src;
-    uint8_t *b = (uint8_t*)dst->data[0];
-    for (unsigned i = 0; i < height; i++) {
-        for (unsigned j = 0; j < width; j++) {
-            b[j] = a[j];
+#include "vif_core.h"
+
+/*
+ * Frame reader that puts the luma plane of each frame straight into a
+ * VmafPicture (or the native engine's buffers). Regular files are mapped read-only and each luma row is
+ * memcpy'd from the page cache into the picture; pipes and failed mappings
+ * fread the rows directly into the picture, and the chroma planes (which
+ * vif, adm and motion don't use) are seeked over, or read into a small
+ * scratch buffer when the input can't seek. With chroma set, the chroma
+ * planes are read into the picture as well.
+ */
+#define READAHEAD_FRAMES 4
+
+typedef struct {
+    FILE *f;
+    uint8_t *map;
+    size_t map_size;
+    size_t pos;
+    size_t ahead;
+    size_t frame_size;
+    unsigned width;
+    unsigned height;
+    uint8_t *skip_buf;  // chroma of unseekable inputs
+    int chroma;
+} YuvReader;
+
+static int open_reader(YuvReader *r, const char *path, unsigned w, unsigned h, long seek) {
+    struct stat st;
+
+    memset(r, 0, sizeof(*r));
+    r->width = w;
+    r->height = h;
+    r->frame_size = w * h * 3 / 2;
+    r->f = fopen(path, "rb");
+    if (!r->f)
+        return -1;
+
+    if (!fstat(fileno(r->f), &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(r->f), 0);
+        if (map != MAP_FAILED) {
+            r->map = (uint8_t *)map;
+            r->map_size = st.st_size;
+            r->pos = r->ahead = seek;
+            madvise(r->map, r->map_size, MADV_SEQUENTIAL);
+            return 0;
         }
-        a += src_stride / sizeof(float);
-        b += dst->stride[0];
     }
+
+    fseek(r->f, seek, SEEK_SET);
+    return 0;
 }
 
-int main(int argc, char *argv[]) {
-    FILE *f[2];
-    uint8_t *buf[2], *plane[2][3];
-    int frame_size, w, h;
-    int frame_index, seek;
-    int i;
-    int stride;
+// skip the chroma planes of the frame just read
+static int skip_chroma(YuvReader *r) {
+    size_t size = r->frame_size - (size_t)r->width * r->height;
 
-    if (argc < 4 || 2 != sscanf(argv[3], "%dx%d", &w, &h)) {
-        printf("test_vif <file1.yuv> <file2.yuv> <width>x<height> [<seek>]\n");
+    if (!fseek(r->f, size, SEEK_CUR))
+        return 0;
+    if (!r->skip_buf && !(r->skip_buf = (uint8_t *)malloc(size)))
         return -1;
+    return fread(r->skip_buf, size, 1, r->f) == 1 ? 0 : -1;
+}
+
+static int fread_plane(FILE *f, uint8_t *dst, ptrdiff_t stride, size_t w, unsigned h) {
+    if (stride == (ptrdiff_t)w)
+        return fread(dst, w * h, 1, f) == 1 ? 0 : -1;
+    for (unsigned y = 0; y < h; y++, dst += stride) {
+        if (fread(dst, w, 1, f) != 1)
+            return -1;
     }
+    return 0;
+}
 
-    f[0] = fopen(argv[1], "rb");
-    f[1] = fopen(argv[2], "rb");
-    sscanf(argv[3], "%dx%d", &w, &h);
+// read the next frame into data (the luma, and the chroma if r->chroma), -1 at the end of the input
+static int read_frame(YuvReader *r, void *const data[3], const ptrdiff_t stride[3]) {
+    int planes = r->chroma ? 3 : 1;
 
-    if (w <= 0 || h <= 0 || w * (int64_t)h >= INT_MAX / 3) {
-        fprintf(stderr, "Dimensions are too large, or invalid\n");
-        return -2;
+    if (!r->map) {
+        for (int i = 0; i < planes; i++) {
+            if (fread_plane(r->f, (uint8_t *)data[i], stride[i], r->width >> !!i, r->height >> !!i))
+                return -1;
+        }
+        return r->chroma ? 0 : skip_chroma(r);
     }
 
-    stride = w * sizeof(float);
-    frame_size = w * h * 3LL / 2;
+    if (r->pos > r->map_size || r->map_size - r->pos < r->frame_size)
+        return -1;
 
-    for (i = 0; i < 2; i++) {
-        buf[i] = (uint8_t *)malloc(frame_size);
-        plane[i][0] = buf[i];
-        plane[i][1] = plane[i][0] + w * h;
-        plane[i][2] = plane[i][1] + w * h / 4;
+    const uint8_t *src = r->map + r->pos;
+    for (int i = 0; i < planes; i++) {
+        uint8_t *dst = (uint8_t *)data[i];
+        size_t w = r->width >> !!i;
+        for (unsigned y = 0; y < r->height >> !!i; y++, src += w, dst += stride[i])
+            memcpy(dst, src, w);
     }
-    
-    seek = argc < 5 ? 0 : atoi(argv[4]);
-    fseek(f[seek < 0], seek < 0 ? -seek : seek, SEEK_SET);
+    r->pos += r->frame_size;
 
-    int err = 0;
+    // keep the kernel a few frames ahead of us
+    if (r->pos + READAHEAD_FRAMES / 2 * r->frame_size > r->ahead) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t start = r->ahead & ~(page - 1);
+        size_t end = r->pos + READAHEAD_FRAMES * r->frame_size;
+        if (end > r->map_size)
+            end = r->map_size;
+        if (end > start)
+            madvise(r->map + start, end - start, MADV_WILLNEED);
+        r->ahead = end;
+    }
+
+    return 0;
+}
+
+static void close_reader(YuvReader *r) {
+    if (r->map)
+        munmap(r->map, r->map_size);
+    if (r->f)
+        fclose(r->f);
+    free(r->skip_buf);
+    memset(r, 0, sizeof(*r));
+}
+
+/*
+ * The readers run on their own thread and fill a ring of picture pairs
+ * ahead of libvmaf (at least MIN_RING, and two per libvmaf thread so that
+ * every worker can have a frame queued behind the one it is extracting).
+ * The pictures come from libvmaf's preallocated pool
+ * (vmaf_preallocate_pictures), so nothing is allocated per frame: the reader
+ * fetches a free pair, which blocks until libvmaf has released enough
+ * earlier pictures, reads the luma into it and hands it over; the main
+ * thread passes it to vmaf_read_pictures, which takes ownership and returns
+ * it to the pool when the feature extractors are done with it. Time the
+ * reader spends waiting for a free slot or picture and time the main thread
+ * spends waiting for a frame are both reported, to tell I/O-bound runs from
+ * compute-bound ones.
+ */
+#define MIN_RING 4
+
+typedef std::chrono::steady_clock Clock;
+
+static double seconds_since(Clock::time_point t) {
+    return std::chrono::duration<double>(Clock::now() - t).count();
+}
+
+typedef struct {
+    VmafPicture pic[2];  // the reference and the distorted frame
+} FramePair;
+
+typedef struct {
+    YuvReader *reader;
+    VmafContext *vmaf;
+    FramePair *ring;
+    int ring_size;
+    int limit;  // frames to produce before stopping, for --segment
+    std::mutex mutex;
+    std::condition_variable cond;
+    int produced;
+    int consumed;
+    int eof;
+    int quit;
+    double read_time;
+    double producer_stall;
+    double consumer_stall;
+} FrameQueue;
+
+static void reader_thread(FrameQueue *q) {
+    for (int n = 0;; n++) {
+        FramePair *pair = &q->ring[n % q->ring_size];
+        Clock::time_point t = Clock::now();
+        {
+            std::unique_lock<std::mutex> lock(q->mutex);
+            q->cond.wait(lock, [q, n] { return n < q->consumed + q->ring_size || q->quit; });
+            if (q->quit)
+                break;
+            if (n == q->limit) {
+                q->eof = 1;
+                q->cond.notify_all();
+                break;
+            }
+        }
+
+        // the slot still holds the pictures the main thread took last time
+        memset(pair->pic, 0, sizeof(pair->pic));
+        int i;
+        for (i = 0; i < 2; i++) {
+            if (vmaf_fetch_preallocated_picture(q->vmaf, &pair->pic[i]))
+                break;
+        }
+        q->producer_stall += seconds_since(t);
+
+        t = Clock::now();
+        if (i == 2) {
+            for (i = 0; i < 2; i++) {
+                if (read_frame(&q->reader[i], pair->pic[i].data, pair->pic[i].stride) < 0)
+                    break;
+            }
+        }
+        q->read_time += seconds_since(t);
+
+        // at the end of either input, give the pictures back to the pool
+        if (i < 2) {
+            for (int j = 0; j < 2; j++) {
+                if (pair->pic[j].ref)
+                    vmaf_picture_unref(&pair->pic[j]);
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(q->mutex);
+        if (i < 2)
+            q->eof = 1;
+        else
+            q->produced++;
+        q->cond.notify_all();
+        if (i < 2)
+            break;
+    }
+}
+
+// wait for frame n, NULL once the inputs are exhausted
+static FramePair *wait_frame(FrameQueue *q, int n) {
+    Clock::time_point t = Clock::now();
+    std::unique_lock<std::mutex> lock(q->mutex);
+    q->cond.wait(lock, [q, n] { return n < q->produced || q->eof; });
+    q->consumer_stall += seconds_since(t);
+    return n < q->produced ? &q->ring[n % q->ring_size] : NULL;
+}
+
+static void release_frame(FrameQueue *q) {
+    std::lock_guard<std::mutex> lock(q->mutex);
+    q->consumed++;
+    q->cond.notify_all();
+}
+
+/*
+ * The scores each libvmaf feature extractor writes, by the name given to
+ * vmaf_use_feature(). A frame is complete once its required scores are
+ * there; the others (debug outputs) are printed as 0 when missing. Features
+ * not listed here are looked up under their own name, and get the chroma
+ * planes in case they use them.
+ */
+#define MAX_FEATURES 8
+#define MAX_OUTPUTS 32
+
+typedef struct {
+    const char *name;   // in libvmaf's feature collector, NULL for the model score
+    const char *label;  // as printed
+    int required;
+} ScoreName;
+
+typedef struct {
+    const char *feature;
+    int luma_only;
+    ScoreName scores[5];
+} FeatureInfo;
+
+static const FeatureInfo known_features[] = {
+    {"vif", 1, {
+        {"VMAF_integer_feature_vif_scale0_score", "VMAF_integer_feature_vif_scale0_score", 1},
+        {"VMAF_integer_feature_vif_scale1_score", "VMAF_integer_feature_vif_scale1_score", 1},
+        {"VMAF_integer_feature_vif_scale2_score", "VMAF_integer_feature_vif_scale2_score", 1},
+        {"VMAF_integer_feature_vif_scale3_score", "VMAF_integer_feature_vif_scale3_score", 1},
+        {"integer_vif", "VMAF_integer_vif", 0},
+    }},
+    {"adm", 1, {
+        {"VMAF_integer_feature_adm2_score", "VMAF_integer_feature_adm2_score", 1},
+        {"integer_adm_scale0", "integer_adm_scale0", 0},
+        {"integer_adm_scale1", "integer_adm_scale1", 0},
+        {"integer_adm_scale2", "integer_adm_scale2", 0},
+        {"integer_adm_scale3", "integer_adm_scale3", 0},
+    }},
+    {"motion", 1, {
+        {"VMAF_integer_feature_motion2_score", "VMAF_integer_feature_motion2_score", 1},
+    }},
+    {"psnr", 0, {
+        {"psnr_y", "psnr_y", 1},
+        {"psnr_cb", "psnr_cb", 1},
+        {"psnr_cr", "psnr_cr", 1},
+    }},
+};
+
+enum {
+    ENGINE_LIBVMAF,
+    ENGINE_NATIVE,
+    ENGINE_COMPARE,
+};
+
+typedef struct {
+    const char *path[2];
+    int w, h;
+    long seek;
+    unsigned n_threads;
+    unsigned n_subsample;
+    const char *features[MAX_FEATURES];
+    int nb_features;
+    VmafModel *model;
+    const char *model_name;
+    ScoreName out[MAX_OUTPUTS];  // what is printed for each frame
+    int nb_out;
+    int chroma;         // some feature needs the chroma planes
+    int profile;        // frames to time each feature on
+    int stream;         // STREAM_*
+    int segment;        // frames per VmafContext when streaming
+    double alert;       // threshold for the rolling mean, 0 = no alerts
+    int alert_window;
+    int alert_scale;
+    int alert_out;      // the vif_scale<alert_scale> entry of out
+    int engine;         // ENGINE_*
+    double tolerance;   // largest difference --engine compare accepts
+} VifOptions;
+
+// the scores of frame index, -1 if a required one isn't there (yet)
+static int get_scores(const VifOptions *opt, VmafContext *vmaf, unsigned index, double *s) {
+    for (int i = 0; i < opt->nb_out; i++) {
+        const ScoreName *n = &opt->out[i];
+        int err = n->name ? vmaf_feature_score_at_index(vmaf, n->name, s + i, index)
+                          : vmaf_score_at_index(vmaf, opt->model, s + i, index);
+        if (err) {
+            if (n->required)
+                return -1;
+            s[i] = 0;
+        }
+    }
+    return 0;
+}
+
+static void print_scores(const VifOptions *opt, int index, const double *s) {
+    printf("frame_index:%d ", index);
+    for (int i = 0; i < opt->nb_out; i++) {
+        printf("%s:%f ", opt->out[i].label, s[i]);
+    }
+    printf("\n");
+}
+
+/*
+ * Streaming mode (--stream text|bin): each frame's scores are written as soon
+ * as libvmaf has all the required ones, instead of after the flush. The
+ * frames are still written in order; a frame that finishes early waits for
+ * the ones before it. libvmaf keeps every score until vmaf_close(), so to
+ * keep memory flat on unbounded inputs the run is cut into segments of
+ * --segment frames, each with its own VmafContext (vif has no state across
+ * frames, so the scores are the same; motion restarts at each segment).
+ * Text lines are the ones printed without --stream; a bin record is the
+ * frame index as a uint32_t followed by one float per score, in the order
+ * of the text line and in native byte order.
+ *
+ * --alert T reports on stderr when the mean of vif_scale<--alert-scale> over
+ * the last --alert-window scored frames drops below T, and again when it
+ * recovers.
+ */
+enum {
+    STREAM_OFF,
+    STREAM_TEXT,
+    STREAM_BIN,
+};
+
+#define DEFAULT_SEGMENT 1000
+#define DEFAULT_ALERT_WINDOW 25
+
+typedef struct {
+    const VifOptions *opt;
+    int base;       // global index of the current context's frame 0
+    int next;       // next frame of the current context to write
+    double *window;
+    int filled;
+    double sum;
+    int alerting;
+} ScoreStream;
+
+static void update_alert(ScoreStream *st, int index, double score) {
+    const VifOptions *opt = st->opt;
+    int slot = st->filled % opt->alert_window;
+
+    if (st->filled >= opt->alert_window)
+        st->sum -= st->window[slot];
+    st->window[slot] = score;
+    st->sum += score;
+    if (++st->filled < opt->alert_window)
+        return;
+
+    double mean = st->sum / opt->alert_window;
+    if (!st->alerting && mean < opt->alert) {
+        fprintf(stderr, "ALERT frame %d: vif_scale%d mean over %d frames %f < %f\n",
+                index, opt->alert_scale, opt->alert_window, mean, opt->alert);
+        st->alerting = 1;
+    } else if (st->alerting && mean >= opt->alert) {
+        fprintf(stderr, "alert cleared frame %d: vif_scale%d mean over %d frames %f\n",
+                index, opt->alert_scale, opt->alert_window, mean);
+        st->alerting = 0;
+    }
+}
+
+/*
+ * Write the frames of the current context that are complete, up to (not
+ * including) frame end. After the flush (done), frames libvmaf has no
+ * scores for are skipped instead of waited for.
+ */
+static void stream_scores(ScoreStream *st, VmafContext *vmaf, int end, int done) {
+    const VifOptions *opt = st->opt;
+    int written = 0;
+
+    for (; st->next < end; st->next++) {
+        double s[MAX_OUTPUTS];
+
+        if (st->next % opt->n_subsample)
+            continue;
+        if (get_scores(opt, vmaf, st->next, s)) {
+            if (done)
+                continue;
+            break;
+        }
+
+        int index = st->base + st->next;
+        if (opt->stream == STREAM_BIN) {
+            uint32_t idx = index;
+            float rec[MAX_OUTPUTS];
+            for (int i = 0; i < opt->nb_out; i++)
+                rec[i] = s[i];
+            fwrite(&idx, sizeof(idx), 1, stdout);
+            fwrite(rec, sizeof(*rec), opt->nb_out, stdout);
+        } else {
+            print_scores(opt, index, s);
+        }
+        if (opt->alert > 0)
+            update_alert(st, index, s[opt->alert_out]);
+        written = 1;
+    }
+    if (written)
+        fflush(stdout);
+}
+
+// a context extracting every feature (and the model's) on n_threads threads
+static VmafContext *open_context(const VifOptions *opt) {
     VmafConfiguration cfg = {
         .log_level = VMAF_LOG_LEVEL_INFO,
-        .n_threads = 1,
-        .n_subsample = 1
+        .n_threads = opt->n_threads,
+        .n_subsample = opt->n_subsample
     };
 
     VmafContext *vmaf;
-    err = vmaf_init(&vmaf, cfg);
-    if (err) {
+    if (vmaf_init(&vmaf, cfg)) {
         fprintf(stderr, "problem initializing VMAF context\n");
-        return -1;
+        return NULL;
     }
 
-    err = vmaf_use_feature(vmaf, "vif", NULL);
-    if (err) {
-        printf("use vif failed! \n");
+    for (int i = 0; i < opt->nb_features; i++) {
+        if (vmaf_use_feature(vmaf, opt->features[i], NULL)) {
+            printf("use %s failed! \n", opt->features[i]);
+            vmaf_close(vmaf);
+            return NULL;
+        }
+    }
+    if (opt->model && vmaf_use_features_from_model(vmaf, opt->model)) {
+        printf("use features from %s failed! \n", opt->model_name);
+        vmaf_close(vmaf);
+        return NULL;
+    }
+
+    VmafPictureConfiguration pic_cfg = {
+        .pic_params = {
+            .w = (unsigned)opt->w,
+            .h = (unsigned)opt->h,
+            .bpc = 8,
+            .pix_fmt = VMAF_PIX_FMT_YUV420P,
+        },
+        .pic_prealloc_method = VMAF_PICTURE_PREALLOCATION_METHOD_HOST,
+    };
+    if (vmaf_preallocate_pictures(vmaf, pic_cfg)) {
+        fprintf(stderr, "problem preallocating pictures\n");
+        vmaf_close(vmaf);
+        return NULL;
+    }
+    return vmaf;
+}
+
+/*
+ * libvmaf doesn't time its extractors, so --profile N measures each feature
+ * (and the model's features together) on a separate single-threaded context
+ * (n_threads 0, where vmaf_read_pictures extracts in the calling thread),
+ * fed copies of the first N frame pairs. This is extra work on top of the
+ * run, so it slows those frames down; it shows which extractor dominates,
+ * not what the threaded run spends on each.
+ */
+typedef struct {
+    const char *label;
+    VmafContext *vmaf;
+    double time;
+} FeatureProfile;
+
+static int open_profiles(const VifOptions *opt, FeatureProfile *prof) {
+    VmafConfiguration cfg = {
+        .log_level = VMAF_LOG_LEVEL_WARNING,
+        .n_threads = 0,
+        .n_subsample = 1
+    };
+    int n = opt->nb_features + !!opt->model;
+
+    for (int i = 0; i < n; i++) {
+        prof[i].label = i < opt->nb_features ? opt->features[i] : opt->model_name;
+        prof[i].time = 0;
+        if (vmaf_init(&prof[i].vmaf, cfg))
+            n = i;
+        else if (i < opt->nb_features ? vmaf_use_feature(prof[i].vmaf, opt->features[i], NULL)
+                                      : vmaf_use_features_from_model(prof[i].vmaf, opt->model))
+            n = i + 1;
+        else
+            continue;
+        while (n--)
+            vmaf_close(prof[n].vmaf);
         return -1;
     }
+    return n;
+}
+
+static void copy_picture(VmafPicture *dst, const VmafPicture *src, int planes) {
+    for (int i = 0; i < planes; i++) {
+        for (unsigned y = 0; y < src->h[i]; y++)
+            memcpy((uint8_t *)dst->data[i] + y * dst->stride[i],
+                   (const uint8_t *)src->data[i] + y * src->stride[i], src->w[i]);
+    }
+}
+
+static int profile_frame(const VifOptions *opt, FeatureProfile *prof, int nb_prof, const FramePair *pair, int index) {
+    for (int i = 0; i < nb_prof; i++) {
+        VmafPicture pic[2];
+        for (int j = 0; j < 2; j++) {
+            if (vmaf_picture_alloc(&pic[j], VMAF_PIX_FMT_YUV420P, 8, opt->w, opt->h)) {
+                if (j)
+                    vmaf_picture_unref(&pic[0]);
+                return -1;
+            }
+            copy_picture(&pic[j], &pair->pic[j], opt->chroma ? 3 : 1);
+        }
+        Clock::time_point t = Clock::now();
+        int err = vmaf_read_pictures(prof[i].vmaf, &pic[0], &pic[1], index);
+        prof[i].time += seconds_since(t);
+        if (err)
+            return -1;
+    }
+    return 0;
+}
+
+static void close_profiles(FeatureProfile *prof, int nb_prof, int frames) {
+    double total = 0;
+
+    for (int i = 0; i < nb_prof; i++) {
+        Clock::time_point t = Clock::now();
+        vmaf_read_pictures(prof[i].vmaf, NULL, NULL, 0);
+        prof[i].time += seconds_since(t);
+        vmaf_close(prof[i].vmaf);
+        total += prof[i].time;
+    }
+    if (!frames)
+        return;
+    fprintf(stderr, "feature times over %d frames, single-threaded:\n", frames);
+    for (int i = 0; i < nb_prof; i++) {
+        fprintf(stderr, "  %-24s %8.3f ms/frame %5.1f%%\n", prof[i].label,
+                prof[i].time * 1000 / frames, total > 0 ? prof[i].time * 100 / total : 0);
+    }
+}
+
+/*
+ * One pass over the inputs: the reader thread produces picture pairs while
+ * this thread submits them, and libvmaf's n_threads workers extract vif.
+ * Returns the number of frames submitted (-1 on error) and *elapsed, the
+ * wall time from opening the inputs to the last flush. Without --stream the
+ * whole run uses one VmafContext, which is left flushed in *out for the
+ * scores; with --stream the scores are written here, segment by segment,
+ * and *out is NULL.
+ */
+static int run_vif(const VifOptions *opt, VmafContext **out, double *elapsed) {
+    YuvReader reader[2];
+    FrameQueue queue;
+    ScoreStream stream;
+    FeatureProfile prof[MAX_FEATURES + 1];
+    int nb_prof = 0;
+    VmafContext *vmaf = NULL;
+    int frames = 0;
+    int err = 0;
+    int i;
+    Clock::time_point start = Clock::now();
+
+    *out = NULL;
+    memset(reader, 0, sizeof(reader));
+    memset(&stream, 0, sizeof(stream));
+    stream.opt = opt;
+    queue.reader = reader;
+    queue.ring = NULL;
+    queue.read_time = queue.producer_stall = queue.consumer_stall = 0;
+
+    // failures before the first segment go through the cleanup at the bottom too
+    for (i = 0; i < 2 && !err; i++) {
+        if (open_reader(&reader[i], opt->path[i], opt->w, opt->h, i == (opt->seek < 0) ? labs(opt->seek) : 0)) {
+            fprintf(stderr, "could not open %s\n", opt->path[i]);
+            err = -1;
+        }
+        reader[i].chroma = opt->chroma;
+    }
+    if (!err && opt->profile && (nb_prof = open_profiles(opt, prof)) < 0) {
+        fprintf(stderr, "problem initializing the profiling contexts\n");
+        nb_prof = 0;
+        err = -1;
+    }
+    if (!err) {
+        queue.ring_size = opt->n_threads * 2 > MIN_RING ? opt->n_threads * 2 : MIN_RING;
+        queue.ring = (FramePair *)calloc(queue.ring_size, sizeof(*queue.ring));
+        if (opt->alert > 0)
+            stream.window = (double *)calloc(opt->alert_window, sizeof(*stream.window));
+        if (!queue.ring || (opt->alert > 0 && !stream.window))
+            err = -1;
+    }
+
+    // one segment unless streaming; a segment that ends early is the last one
+    while (!err) {
+        int frame_index;
+
+        vmaf = open_context(opt);
+        if (!vmaf) {
+            err = -1;
+            break;
+        }
+        queue.vmaf = vmaf;
+        queue.produced = queue.consumed = queue.eof = queue.quit = 0;
+        queue.limit = opt->stream ? opt->segment : INT_MAX;
+        stream.base = frames;
+        stream.next = 0;
+
+        std::thread reader_worker(reader_thread, &queue);
+
+        for (frame_index = 0;; frame_index++) {
+            FramePair *pair = wait_frame(&queue, frame_index);
+            if (!pair)
+                break;
+
+            // pair->pic[0]-lumance for refence image
+            // pair->pic[1]-lumance for distortion image
+            // vmaf_read_pictures takes ownership and unrefs them back to the pool
+            VmafPicture pic_ref = pair->pic[0], pic_dist = pair->pic[1];
+            if (frames + frame_index < opt->profile && profile_frame(opt, prof, nb_prof, pair, frames + frame_index)) {
+                printf("problem profiling features\n");
+                err = -1;
+                break;
+            }
+            release_frame(&queue);
+
+            err = vmaf_read_pictures(vmaf, &pic_ref, &pic_dist, frame_index);
+            if (err) {
+                printf("problem reading pictures\n");
+                break;
+            }
+            if (opt->stream)
+                stream_scores(&stream, vmaf, frame_index + 1, 0);
+        }
+
+        // after an early break the reader may still be waiting for a slot
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.quit = 1;
+            queue.cond.notify_all();
+        }
+        reader_worker.join();
+
+        // pairs the reader produced but we never scored (after an early break)
+        for (int n = queue.consumed; n < queue.produced; n++) {
+            vmaf_picture_unref(&queue.ring[n % queue.ring_size].pic[0]);
+            vmaf_picture_unref(&queue.ring[n % queue.ring_size].pic[1]);
+        }
+        frames += frame_index;
 
-    for (frame_index = 0;; frame_index++) {
-        if (fread(buf[0], frame_size, 1, f[0]) != 1)
+        if (!err) {
+            err = vmaf_read_pictures(vmaf, NULL, NULL, 0);
+            if (err)
+                printf("problem flushing context\n");
+        }
+        if (err || !opt->stream)
             break;
-        if (fread(buf[1], frame_size, 1, f[1]) != 1)
+        stream_scores(&stream, vmaf, frame_index, 1);
+        vmaf_close(vmaf);
+        vmaf = NULL;
+        if (frame_index < opt->segment)
             break;
-        
-        // plane[0][0]-lumance for refence image
-        // plane[1][0]-lumance for distortion image
-        VmafPicture pic_ref, pic_dist;
-        vmaf_picture_alloc(&pic_ref,  VMAF_PIX_FMT_YUV420P, 8, w, h);
-        vmaf_picture_alloc(&pic_dist, VMAF_PIX_FMT_YUV420P, 8, w, h);
-        copy_data(plane[0][0], &pic_ref, w, h, stride);
-        copy_data(plane[1][0], &pic_dist, w, h, stride);
-
-        err = vmaf_read_pictures(vmaf, &pic_ref, &pic_dist, frame_index);
+    }
+    if (queue.ring)
+        fprintf(stderr, "reader: %.3fs reading, %.3fs waiting for free buffers | vmaf: %.3fs waiting for input\n",
+                queue.read_time, queue.producer_stall, queue.consumer_stall);
+    if (opt->profile)
+        close_profiles(prof, nb_prof, frames < opt->profile ? frames : opt->profile);
+
+    close_reader(&reader[0]);
+    close_reader(&reader[1]);
+    free(queue.ring);
+    free(stream.window);
+
+    *elapsed = seconds_since(start);
+    if (err) {
+        if (vmaf)
+            vmaf_close(vmaf);
+        return -1;
+    }
+    *out = vmaf;
+    return frames;
+}
+
+/*
+ * --engine native scores vif with vif_core.h instead of libvmaf, and with
+ * --chroma the U and V planes too (libvmaf's vif is luma only). The frames
+ * are scored in parallel: each of the n_threads workers has its own
+ * VIFContext and frame buffers, reads the next pair under the lock (so the
+ * readers stay sequential) and scores it outside it. The scores are kept per
+ * frame, nb_out of them in the order of opt->out, and printed in order after
+ * the run like libvmaf's.
+ */
+static const ScoreName vif_chroma_scores[2][5] = {
+    {
+        {NULL, "VMAF_integer_feature_vif_scale0_score_u", 1},
+        {NULL, "VMAF_integer_feature_vif_scale1_score_u", 1},
+        {NULL, "VMAF_integer_feature_vif_scale2_score_u", 1},
+        {NULL, "VMAF_integer_feature_vif_scale3_score_u", 1},
+        {NULL, "VMAF_integer_vif_u", 1},
+    }, {
+        {NULL, "VMAF_integer_feature_vif_scale0_score_v", 1},
+        {NULL, "VMAF_integer_feature_vif_scale1_score_v", 1},
+        {NULL, "VMAF_integer_feature_vif_scale2_score_v", 1},
+        {NULL, "VMAF_integer_feature_vif_scale3_score_v", 1},
+        {NULL, "VMAF_integer_vif_v", 1},
+    },
+};
+
+typedef struct {
+    const VifOptions *opt;
+    YuvReader *reader;
+    std::mutex mutex;
+    int next;       // index of the next frame to read
+    int eof;
+    int err;
+    int keep;       // store the scores, not just time the run
+    double *scores; // nb_out per frame
+    int capacity;   // frames scores has room for
+} NativeRun;
+
+static void native_worker(NativeRun *run) {
+    const VifOptions *opt = run->opt;
+    int planes = opt->chroma ? 3 : 1;
+    size_t luma = (size_t)opt->w * opt->h;
+    uint8_t *buf = (uint8_t *)malloc(luma * 3);
+    VIFContext ctx;
+    void *data[2][3];
+    ptrdiff_t stride[3] = {opt->w, opt->w >> 1, opt->w >> 1};
+
+    if (!buf || vif_init(&ctx, opt->w, opt->h)) {
+        free(buf);
+        std::lock_guard<std::mutex> lock(run->mutex);
+        run->err = -1;
+        return;
+    }
+    for (int i = 0; i < 2; i++) {
+        data[i][0] = buf + i * luma * 3 / 2;
+        data[i][1] = (uint8_t *)data[i][0] + luma;
+        data[i][2] = (uint8_t *)data[i][1] + luma / 4;
+    }
+
+    for (;;) {
+        int n;
+        {
+            std::lock_guard<std::mutex> lock(run->mutex);
+            if (run->eof || run->err)
+                break;
+            if (read_frame(&run->reader[0], data[0], stride) < 0 || read_frame(&run->reader[1], data[1], stride) < 0) {
+                run->eof = 1;
+                break;
+            }
+            n = run->next++;
+        }
+        if (n % opt->n_subsample)
+            continue;
+
+        double s[MAX_OUTPUTS];
+        int err = 0;
+        for (int p = 0; p < planes; p++) {
+            VifScore score;
+            err = vif_plane(&ctx, (const uint8_t *)data[0][p], stride[p], (const uint8_t *)data[1][p], stride[p],
+                            opt->w >> !!p, opt->h >> !!p, 8, &score);
+            if (err)
+                break;
+            for (int k = 0; k < VIF_SCALES; k++)
+                s[p * 5 + k] = score.scale[k];
+            s[p * 5 + 4] = score.vif;
+        }
+
+        std::lock_guard<std::mutex> lock(run->mutex);
         if (err) {
-            printf("problem reading pictures\n");
+            fprintf(stderr, "problem scoring frame %d, too small for vif?\n", n);
+            run->err = -1;
             break;
         }
+        if (!run->keep)
+            continue;
+        if (n >= run->capacity) {
+            int capacity = run->capacity ? run->capacity * 2 : 256;
+            while (capacity <= n)
+                capacity *= 2;
+            double *scores = (double *)realloc(run->scores, (size_t)capacity * opt->nb_out * sizeof(*scores));
+            if (!scores) {
+                run->err = -1;
+                break;
+            }
+            run->scores = scores;
+            run->capacity = capacity;
+        }
+        memcpy(run->scores + (size_t)n * opt->nb_out, s, opt->nb_out * sizeof(*s));
+    }
 
-        vmaf_picture_unref(&pic_ref);
-        vmaf_picture_unref(&pic_dist);
+    vif_uninit(&ctx);
+    free(buf);
+}
+
+/*
+ * The native counterpart of run_vif: returns the number of frames read (-1
+ * on error) and *elapsed. With out set, *out gets the scores (see
+ * NativeRun), to be freed by the caller.
+ */
+static int run_native(const VifOptions *opt, double **out, double *elapsed) {
+    YuvReader reader[2];
+    NativeRun run;
+    std::thread *workers;
+    Clock::time_point start = Clock::now();
+
+    for (int i = 0; i < 2; i++) {
+        if (open_reader(&reader[i], opt->path[i], opt->w, opt->h, i == (opt->seek < 0) ? labs(opt->seek) : 0)) {
+            fprintf(stderr, "could not open %s\n", opt->path[i]);
+            if (i)
+                close_reader(&reader[0]);
+            return -1;
+        }
+        reader[i].chroma = opt->chroma;
     }
 
-    err = vmaf_read_pictures(vmaf, NULL, NULL, 0);
-    if (err) {
-        printf("problem flushing context\n");
-        return err;
+    run.opt = opt;
+    run.reader = reader;
+    run.next = run.eof = run.err = 0;
+    run.keep = !!out;
+    run.scores = NULL;
+    run.capacity = 0;
+
+    workers = new std::thread[opt->n_threads];
+    for (unsigned i = 0; i < opt->n_threads; i++)
+        workers[i] = std::thread(native_worker, &run);
+    for (unsigned i = 0; i < opt->n_threads; i++)
+        workers[i].join();
+    delete[] workers;
+
+    close_reader(&reader[0]);
+    close_reader(&reader[1]);
+    *elapsed = seconds_since(start);
+    if (run.err) {
+        free(run.scores);
+        return -1;
     }
+    if (out)
+        *out = run.scores;
+    return run.next;
+}
+
+/*
+ * --engine compare runs libvmaf and the native engine over the same frames
+ * and reports, for each luma score libvmaf gives, the largest and the mean
+ * absolute difference, and the throughput of both. Fails (returns 1) when a
+ * difference is above --tolerance.
+ */
+#define DEFAULT_TOLERANCE 1e-4
+
+static int compare_engines(const VifOptions *opt) {
+    VmafContext *vmaf;
+    double *native;
+    double t_libvmaf, t_native;
+    double max_diff[MAX_OUTPUTS] = {0}, sum_diff[MAX_OUTPUTS] = {0};
+    int count[MAX_OUTPUTS] = {0};
+    int fail = 0;
 
-    double s[5] = {0};
-    for (int i = 0; i < frame_index; i++) {
-        vmaf_feature_score_at_index(vmaf, "VMAF_integer_feature_vif_scale0_score", s, i);
-        vmaf_feature_score_at_index(vmaf, "VMAF_integer_feature_vif_scale1_score", s + 1, i);
-        vmaf_feature_score_at_index(vmaf, "VMAF_integer_feature_vif_scale2_score", s + 2, i);
-        vmaf_feature_score_at_index(vmaf, "VMAF_integer_feature_vif_scale3_score", s + 3, i);
-        vmaf_feature_score_at_index(vmaf, "integer_vif", s + 4, i);
+    int frames = run_vif(opt, &vmaf, &t_libvmaf);
+    if (frames < 0)
+        return -1;
+    if (run_native(opt, &native, &t_native) != frames) {
+        fprintf(stderr, "the native engine read a different number of frames\n");
+        vmaf_close(vmaf);
+        return -1;
+    }
 
-        printf("frame_index:%d ", i);
-        for (int j = 0; j < 4; j++) {
-            printf("VMAF_integer_feature_vif_scale%d_score:%f ", j, s[j]);
+    for (int n = 0; n < frames; n += opt->n_subsample) {
+        for (int i = 0; i < opt->nb_out; i++) {
+            double s;
+            if (vmaf_feature_score_at_index(vmaf, opt->out[i].name, &s, n))
+                continue;
+            double diff = fabs(s - native[(size_t)n * opt->nb_out + i]);
+            if (diff > max_diff[i])
+                max_diff[i] = diff;
+            sum_diff[i] += diff;
+            count[i]++;
         }
-        printf("VMAF_integer_vif:%f \n", s[4]);
+    }
+    vmaf_close(vmaf);
+    free(native);
+
+    printf("%-40s %12s %12s\n", "score", "max diff", "mean diff");
+    for (int i = 0; i < opt->nb_out; i++) {
+        if (!count[i])
+            continue;
+        printf("%-40s %12.3e %12.3e\n", opt->out[i].label, max_diff[i], sum_diff[i] / count[i]);
+        fail |= max_diff[i] > opt->tolerance;
+    }
+    printf("libvmaf: %.2f fps, native: %.2f fps (%.2fx) with %u threads\n",
+           frames / t_libvmaf, frames / t_native, t_libvmaf / t_native, opt->n_threads);
+    if (fail)
+        printf("FAIL: difference above the tolerance %g\n", opt->tolerance);
+    return fail;
+}
+
+// fill in opt->out, opt->chroma and opt->alert_out from the features and the model
+static int add_outputs(VifOptions *opt) {
+    char label[64];
+
+    for (int i = 0; i < opt->nb_features; i++) {
+        const FeatureInfo *info = NULL;
+        for (size_t j = 0; j < sizeof(known_features) / sizeof(*known_features); j++) {
+            if (!strcmp(opt->features[i], known_features[j].feature))
+                info = &known_features[j];
+        }
+
+        if (!info) {
+            if (opt->nb_out == MAX_OUTPUTS)
+                return -1;
+            opt->out[opt->nb_out++] = (ScoreName){opt->features[i], opt->features[i], 1};
+            opt->chroma = 1;
+            continue;
+        }
+        for (int j = 0; j < 5 && info->scores[j].name; j++) {
+            if (opt->nb_out == MAX_OUTPUTS)
+                return -1;
+            opt->out[opt->nb_out++] = info->scores[j];
+        }
+        if (!info->luma_only)
+            opt->chroma = 1;
+    }
+
+    if (opt->model) {
+        if (opt->nb_out == MAX_OUTPUTS)
+            return -1;
+        opt->out[opt->nb_out++] = (ScoreName){NULL, opt->model_name, 1};
+    }
+
+    opt->alert_out = -1;
+    snprintf(label, sizeof(label), "VMAF_integer_feature_vif_scale%d_score", opt->alert_scale);
+    for (int i = 0; i < opt->nb_out; i++) {
+        if (opt->out[i].name && !strcmp(opt->out[i].name, label))
+            opt->alert_out = i;
     }
     return 0;
-}
\ No newline at end of file
+}
+
+int main(int argc, char *argv[]) {
+    VifOptions opt;
+    const char *args[4];
+    int nb_args = 0;
+    int scaling = 0;
+    char *features = NULL;
+    int chroma = 0;
+    VmafContext *vmaf;
+    double elapsed;
+    int frames;
+
+    memset(&opt, 0, sizeof(opt));
+    opt.n_threads = 1;
+    opt.n_subsample = 1;
+    opt.segment = DEFAULT_SEGMENT;
+    opt.alert_window = DEFAULT_ALERT_WINDOW;
+    opt.tolerance = DEFAULT_TOLERANCE;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+            opt.n_threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--subsample") && i + 1 < argc)
+            opt.n_subsample = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--scaling") && i + 1 < argc)
+            scaling = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--stream") && i + 1 < argc) {
+            i++;
+            opt.stream = !strcmp(argv[i], "text") ? STREAM_TEXT : !strcmp(argv[i], "bin") ? STREAM_BIN : -1;
+        } else if (!strcmp(argv[i], "--segment") && i + 1 < argc)
+            opt.segment = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--alert") && i + 1 < argc)
+            opt.alert = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--alert-window") && i + 1 < argc)
+            opt.alert_window = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--alert-scale") && i + 1 < argc)
+            opt.alert_scale = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--features") && i + 1 < argc)
+            features = argv[++i];
+        else if (!strcmp(argv[i], "--model") && i + 1 < argc)
+            opt.model_name = argv[++i];
+        else if (!strcmp(argv[i], "--profile") && i + 1 < argc)
+            opt.profile = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--engine") && i + 1 < argc) {
+            i++;
+            opt.engine = !strcmp(argv[i], "libvmaf") ? ENGINE_LIBVMAF : !strcmp(argv[i], "native") ? ENGINE_NATIVE :
+                         !strcmp(argv[i], "compare") ? ENGINE_COMPARE : -1;
+        } else if (!strcmp(argv[i], "--chroma"))
+            chroma = 1;
+        else if (!strcmp(argv[i], "--tolerance") && i + 1 < argc)
+            opt.tolerance = atof(argv[++i]);
+        else if (nb_args < 4)
+            args[nb_args++] = argv[i];
+    }
+
+    if (nb_args < 3 || 2 != sscanf(args[2], "%dx%d", &opt.w, &opt.h) ||
+        (int)opt.n_threads < 1 || (int)opt.n_subsample < 1 || scaling < 0 || opt.stream < 0 || opt.segment < 1 ||
+        opt.alert < 0 || opt.alert_window < 1 || opt.alert_scale < 0 || opt.alert_scale > 3 || opt.profile < 0 ||
+        opt.engine < 0 || opt.tolerance < 0) {
+        printf("test_vif <file1.yuv> <file2.yuv> <width>x<height> [<seek>] [--threads N] [--subsample N] [--scaling N]\n"
+               "         [--features vif,adm,motion,...] [--model <version>|<model.json>] [--profile N]\n"
+               "         [--stream text|bin] [--segment N] [--alert T] [--alert-window N] [--alert-scale 0-3]\n"
+               "         [--engine libvmaf|native|compare] [--chroma] [--tolerance T]\n");
+        return -1;
+    }
+
+    if (opt.w <= 0 || opt.h <= 0 || opt.w * (int64_t)opt.h >= INT_MAX / 3) {
+        fprintf(stderr, "Dimensions are too large, or invalid\n");
+        return -2;
+    }
+
+    opt.path[0] = args[0];
+    opt.path[1] = args[1];
+    opt.seek = nb_args < 4 ? 0 : atoi(args[3]);
+
+    // the native engine is vif only
+    if (opt.engine != ENGINE_LIBVMAF && (features || opt.model_name || opt.stream || opt.profile)) {
+        fprintf(stderr, "--features, --model, --stream and --profile need --engine libvmaf\n");
+        return -1;
+    }
+    if (chroma && opt.engine != ENGINE_NATIVE) {
+        fprintf(stderr, "--chroma needs --engine native\n");
+        return -1;
+    }
+    if (scaling && opt.engine == ENGINE_COMPARE) {
+        fprintf(stderr, "--scaling and --engine compare can't be combined\n");
+        return -1;
+    }
+
+    // vif alone unless told otherwise; every feature is extracted from the same read
+    if (features) {
+        for (char *f = strtok(features, ","); f; f = strtok(NULL, ",")) {
+            if (opt.nb_features == MAX_FEATURES) {
+                fprintf(stderr, "at most %d features\n", MAX_FEATURES);
+                return -1;
+            }
+            opt.features[opt.nb_features++] = f;
+        }
+    } else if (!opt.model_name) {
+        opt.features[opt.nb_features++] = "vif";
+    }
+
+    if (opt.model_name) {
+        VmafModelConfig model_cfg = {
+            .name = "vmaf",
+            .flags = VMAF_MODEL_FLAGS_DEFAULT,
+        };
+        struct stat st;
+        int err = !stat(opt.model_name, &st) ? vmaf_model_load_from_path(&opt.model, &model_cfg, opt.model_name)
+                                             : vmaf_model_load(&opt.model, &model_cfg, opt.model_name);
+        if (err) {
+            fprintf(stderr, "problem loading model %s\n", opt.model_name);
+            return -1;
+        }
+    }
+
+    if (add_outputs(&opt)) {
+        fprintf(stderr, "too many scores, at most %d\n", MAX_OUTPUTS);
+        return -1;
+    }
+    if (chroma) {
+        opt.chroma = 1;
+        for (int p = 0; p < 2; p++) {
+            for (int j = 0; j < 5; j++)
+                opt.out[opt.nb_out++] = vif_chroma_scores[p][j];
+        }
+    }
+
+    if (opt.alert > 0 && !opt.stream) {
+        fprintf(stderr, "--alert needs --stream\n");
+        return -1;
+    }
+    if (opt.alert > 0 && opt.alert_out < 0) {
+        fprintf(stderr, "--alert needs the vif feature\n");
+        return -1;
+    }
+    if (scaling && opt.stream) {
+        fprintf(stderr, "--scaling and --stream can't be combined\n");
+        return -1;
+    }
+    // libvmaf subsamples by the index within each context, keep the phase
+    opt.segment = (opt.segment + opt.n_subsample - 1) / opt.n_subsample * opt.n_subsample;
+
+    /*
+     * --scaling N runs the whole pipeline N times, with 1..N libvmaf (or native) threads,
+     * and reports frames/second and the speedup over one thread. Files are
+     * read again each time (from the page cache after the first run).
+     */
+    if (scaling) {
+        double base = 0;
+        printf("threads       fps   speedup\n");
+        for (unsigned t = 1; t <= (unsigned)scaling; t++) {
+            opt.n_threads = t;
+            frames = opt.engine == ENGINE_NATIVE ? run_native(&opt, NULL, &elapsed) : run_vif(&opt, &vmaf, &elapsed);
+            if (frames < 0)
+                return -1;
+            double fps = frames / elapsed;
+            if (t == 1)
+                base = fps;
+            printf("%7u %9.2f %8.2fx\n", t, fps, base > 0 ? fps / base : 0);
+            if (opt.engine == ENGINE_LIBVMAF)
+                vmaf_close(vmaf);
+        }
+        if (opt.model)
+            vmaf_model_destroy(opt.model);
+        return 0;
+    }
+
+    if (opt.engine == ENGINE_COMPARE)
+        return compare_engines(&opt);
+
+    if (opt.engine == ENGINE_NATIVE) {
+        double *scores = NULL;
+        frames = run_native(&opt, &scores, &elapsed);
+        if (frames < 0)
+            return -1;
+        for (int i = 0; i < frames; i += opt.n_subsample)
+            print_scores(&opt, i, scores + (size_t)i * opt.nb_out);
+        free(scores);
+        fprintf(stderr, "%d frames in %.3fs (%.2f fps) with %u native threads\n", frames, elapsed, frames / elapsed, opt.n_threads);
+        return 0;
+    }
+
+    frames = run_vif(&opt, &vmaf, &elapsed);
+    if (frames < 0)
+        return -1;
+
+    // with --subsample only every n_subsample-th frame has scores
+    double s[MAX_OUTPUTS];
+    for (int i = 0; vmaf && i < frames; i++) {
+        if (!get_scores(&opt, vmaf, i, s))
+            print_scores(&opt, i, s);
+    }
+    if (vmaf)
+        vmaf_close(vmaf);
+    if (opt.model)
+        vmaf_model_destroy(opt.model);
+    fprintf(stderr, "%d frames in %.3fs (%.2f fps) with %u threads\n", frames, elapsed, frames / elapsed, opt.n_threads);
+    return 0;
+}
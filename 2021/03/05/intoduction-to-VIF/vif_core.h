@@ -0,0 +1,574 @@
+/*
+ * vif_core.h
+ * A native integer VIF engine that needs no libvmaf. It follows the fixed
+ * point design of libvmaf's integer vif extractor, so its four scale scores
+ * are comparable to VMAF_integer_feature_vif_scaleN_score:
+ *
+ *   - the planes are held as 16-bit samples normalised to 8-bit range in 8.8
+ *     fixed point, at every scale and every bit depth
+ *   - the Gaussians are the extractor's Q16 tables (17, 9, 5 and 3 taps),
+ *     applied vertically then horizontally with mirrored edges
+ *   - scales 1..3 are the previous scale filtered with that scale's Gaussian
+ *     and decimated by 2
+ *   - the local means, variances and covariance are integers (sigma in Q16
+ *     of 8-bit pixel^2, so sigma_nsq = 2 is 65536 << 1)
+ *   - the logs come from a table of log2 of 16-bit mantissas, with the
+ *     exponents added back in
+ *
+ * The vertical filter, horizontal filter and per-pixel statistics have C and
+ * AVX2 versions, picked at run time; the AVX2 ones give the same integers as
+ * the C ones, so the scores don't depend on the CPU. Build with -DVIF_NO_SIMD
+ * to use the C versions only. Used by test_vif.cpp (--engine native) and
+ * bench_vif.cpp; everything is static, so each program compiles its own copy.
+ */
+#ifndef VIF_CORE_H
+#define VIF_CORE_H
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mutex>
+
+#if !defined(VIF_NO_SIMD) && (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define VIF_ARCH_X86 1
+#include <immintrin.h>
+#endif
+
+#define VIF_SCALES 4
+#define VIF_MAX_TAPS 17
+#define VIF_PAD (VIF_MAX_TAPS / 2)
+#define VIF_SIGMA_NSQ (65536 << 1)
+#define VIF_EPS (65536 * 1.0e-10)
+#define VIF_GAIN_LIMIT 100.0  // libvmaf's default vif_enhn_gain_limit
+
+static const uint16_t vif_filter[VIF_SCALES][VIF_MAX_TAPS] = {
+    {489, 935, 1640, 2640, 3896, 5274, 6547, 7455, 7784, 7455, 6547, 5274, 3896, 2640, 1640, 935, 489},
+    {1244, 3663, 7925, 12590, 14692, 12590, 7925, 3663, 1244},
+    {3571, 16004, 26386, 16004, 3571},
+    {10904, 43728, 10904},
+};
+
+static const int vif_filter_taps[VIF_SCALES] = {17, 9, 5, 3};
+
+// log2(i) * 2048 at [i - 32768] for the mantissas i in [32768, 65535]; one
+// more entry so that the AVX2 lookup can read 32 bits at the last index
+static const uint16_t *vif_log2_table() {
+    static uint16_t table[32769];
+    static std::once_flag once;
+    std::call_once(once, [] {
+        for (int i = 0; i < 32768; i++)
+            table[i] = (uint16_t)round(log2f((float)(i + 32768)) * 2048);
+    });
+    return table;
+}
+
+// the top 16 bits of v, with *x set so that log2(v) = log2(mantissa) - *x
+static inline uint16_t vif_best16(uint64_t v, int *x) {
+    int e = 63 - __builtin_clzll(v);
+    *x = 15 - e;
+    return e >= 15 ? v >> (e - 15) : v << (15 - e);
+}
+
+/*
+ * The per-pixel sums of one scale. Pixels with sigma1_sq < sigma_nsq count
+ * 1 - sigma2_sq / sigma_max^2 in num and 1 in den; the others add the log2
+ * terms, kept as table values (/2048) and exponents.
+ */
+typedef struct {
+    int64_t num_log;
+    int64_t num_x;
+    int64_t den_log;
+    int64_t den_x;
+    int64_t nb_log;
+    int64_t num_non_log;
+    int64_t nb_non_log;
+} VifAccum;
+
+typedef struct {
+    double scale[VIF_SCALES];  // num / den of each scale
+    double vif;                // all four scales' num / den
+} VifScore;
+
+static inline void vif_stat_pixel(uint32_t mu1, uint32_t mu2, uint32_t xx, uint32_t yy, uint32_t xy,
+                                  double gain_limit, const uint16_t *log2_table, VifAccum *acc) {
+    uint32_t mu1_sq = (uint32_t)(((uint64_t)mu1 * mu1 + 0x80000000) >> 32);
+    uint32_t mu2_sq = (uint32_t)(((uint64_t)mu2 * mu2 + 0x80000000) >> 32);
+    uint32_t mu1_mu2 = (uint32_t)(((uint64_t)mu1 * mu2 + 0x80000000) >> 32);
+    int32_t sigma1_sq = (int32_t)(xx - mu1_sq);
+    int32_t sigma2_sq = (int32_t)(yy - mu2_sq);
+    int32_t sigma12 = (int32_t)(xy - mu1_mu2);
+    int x, x1, x2;
+
+    if (sigma2_sq < 0)
+        sigma2_sq = 0;
+    if (sigma1_sq < VIF_SIGMA_NSQ) {
+        acc->num_non_log += sigma2_sq;
+        acc->nb_non_log++;
+        return;
+    }
+
+    // den: log2(1 + sigma1_sq / sigma_nsq) = log2(sigma_nsq + sigma1_sq) - 17
+    uint16_t den = vif_best16((uint32_t)VIF_SIGMA_NSQ + (uint32_t)sigma1_sq, &x);
+    acc->den_log += log2_table[den - 32768];
+    acc->den_x += x;
+    acc->nb_log++;
+
+    // num: log2(1 + g^2 sigma1_sq / (sv_sq + sigma_nsq)), 0 unless g > 0
+    if (sigma12 > 0 && sigma2_sq > 0) {
+        double g = sigma12 / (sigma1_sq + VIF_EPS);
+        int32_t sv_sq = (int32_t)(sigma2_sq - g * sigma12);
+        if (sv_sq < 0)
+            sv_sq = 0;
+        if (g > gain_limit)
+            g = gain_limit;
+        uint32_t numer1 = sv_sq + VIF_SIGMA_NSQ;
+        int64_t numer1_tmp = (int64_t)(g * g * sigma1_sq) + numer1;
+        uint16_t n = vif_best16(numer1_tmp, &x1);
+        uint16_t d = vif_best16(numer1, &x2);
+        acc->num_log += log2_table[n - 32768] - log2_table[d - 32768];
+        acc->num_x += x2 - x1;
+    }
+}
+
+// the five moments of one row: Σf·ref, Σf·dis (rounded to 8.8) and Σf·ref², Σf·dis², Σf·ref·dis (rounded to Q16)
+static void vif_vfilter_c(const uint16_t *const ref[], const uint16_t *const dis[], const uint16_t *f, int taps,
+                          int width, uint32_t *const out[5]) {
+    for (int x = 0; x < width; x++) {
+        uint32_t mu1 = 0, mu2 = 0;
+        uint64_t xx = 0, yy = 0, xy = 0;
+        for (int k = 0; k < taps; k++) {
+            uint32_t r = ref[k][x], d = dis[k][x];
+            uint32_t fr = f[k] * r, fd = f[k] * d;
+            mu1 += fr;
+            mu2 += fd;
+            xx += (uint64_t)fr * r;
+            yy += (uint64_t)fd * d;
+            xy += (uint64_t)fr * d;
+        }
+        out[0][x] = (mu1 + 32768) >> 16;
+        out[1][x] = (mu2 + 32768) >> 16;
+        out[2][x] = (uint32_t)((xx + 32768) >> 16);
+        out[3][x] = (uint32_t)((yy + 32768) >> 16);
+        out[4][x] = (uint32_t)((xy + 32768) >> 16);
+    }
+}
+
+// in[i][x + k] is column x - taps / 2 + k; the means are left in Q16
+static void vif_hfilter_c(const uint32_t *const in[5], const uint16_t *f, int taps, int width, uint32_t *const out[5]) {
+    for (int x = 0; x < width; x++) {
+        uint32_t mu1 = 0, mu2 = 0;
+        uint64_t xx = 0, yy = 0, xy = 0;
+        for (int k = 0; k < taps; k++) {
+            mu1 += f[k] * in[0][x + k];
+            mu2 += f[k] * in[1][x + k];
+            xx += (uint64_t)f[k] * in[2][x + k];
+            yy += (uint64_t)f[k] * in[3][x + k];
+            xy += (uint64_t)f[k] * in[4][x + k];
+        }
+        out[0][x] = mu1;
+        out[1][x] = mu2;
+        out[2][x] = (uint32_t)((xx + 32768) >> 16);
+        out[3][x] = (uint32_t)((yy + 32768) >> 16);
+        out[4][x] = (uint32_t)((xy + 32768) >> 16);
+    }
+}
+
+static void vif_stat_c(const uint32_t *const in[5], int width, double gain_limit, VifAccum *acc) {
+    const uint16_t *log2_table = vif_log2_table();
+
+    for (int x = 0; x < width; x++)
+        vif_stat_pixel(in[0][x], in[1][x], in[2][x], in[3][x], in[4][x], gain_limit, log2_table, acc);
+}
+
+#if VIF_ARCH_X86
+/*
+ * 8 columns at a time in 32-bit lanes. f·v fits in 32 bits and so does the
+ * sum of the means, but the squares need 64: the even and odd lanes are
+ * multiplied and accumulated separately with vpmuludq.
+ */
+__attribute__((target("avx2")))
+static inline __m256i vif_pack64_avx2(__m256i even, __m256i odd) {
+    const __m256i round = _mm256_set1_epi64x(32768);
+    even = _mm256_srli_epi64(_mm256_add_epi64(even, round), 16);
+    odd = _mm256_slli_epi64(_mm256_srli_epi64(_mm256_add_epi64(odd, round), 16), 32);
+    return _mm256_blend_epi32(even, odd, 0xaa);
+}
+
+__attribute__((target("avx2")))
+static void vif_vfilter_avx2(const uint16_t *const ref[], const uint16_t *const dis[], const uint16_t *f, int taps,
+                             int width, uint32_t *const out[5]) {
+    const __m256i round = _mm256_set1_epi32(32768);
+    int x = 0;
+
+    for (; x + 8 <= width; x += 8) {
+        __m256i mu1 = _mm256_setzero_si256(), mu2 = _mm256_setzero_si256();
+        __m256i xx0 = _mm256_setzero_si256(), xx1 = _mm256_setzero_si256();
+        __m256i yy0 = _mm256_setzero_si256(), yy1 = _mm256_setzero_si256();
+        __m256i xy0 = _mm256_setzero_si256(), xy1 = _mm256_setzero_si256();
+        for (int k = 0; k < taps; k++) {
+            __m256i fk = _mm256_set1_epi32(f[k]);
+            __m256i r = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(ref[k] + x)));
+            __m256i d = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(dis[k] + x)));
+            __m256i fr = _mm256_mullo_epi32(fk, r);
+            __m256i fd = _mm256_mullo_epi32(fk, d);
+            __m256i r1 = _mm256_srli_epi64(r, 32), d1 = _mm256_srli_epi64(d, 32);
+            __m256i fr1 = _mm256_srli_epi64(fr, 32), fd1 = _mm256_srli_epi64(fd, 32);
+            mu1 = _mm256_add_epi32(mu1, fr);
+            mu2 = _mm256_add_epi32(mu2, fd);
+            xx0 = _mm256_add_epi64(xx0, _mm256_mul_epu32(fr, r));
+            xx1 = _mm256_add_epi64(xx1, _mm256_mul_epu32(fr1, r1));
+            yy0 = _mm256_add_epi64(yy0, _mm256_mul_epu32(fd, d));
+            yy1 = _mm256_add_epi64(yy1, _mm256_mul_epu32(fd1, d1));
+            xy0 = _mm256_add_epi64(xy0, _mm256_mul_epu32(fr, d));
+            xy1 = _mm256_add_epi64(xy1, _mm256_mul_epu32(fr1, d1));
+        }
+        _mm256_storeu_si256((__m256i *)(out[0] + x), _mm256_srli_epi32(_mm256_add_epi32(mu1, round), 16));
+        _mm256_storeu_si256((__m256i *)(out[1] + x), _mm256_srli_epi32(_mm256_add_epi32(mu2, round), 16));
+        _mm256_storeu_si256((__m256i *)(out[2] + x), vif_pack64_avx2(xx0, xx1));
+        _mm256_storeu_si256((__m256i *)(out[3] + x), vif_pack64_avx2(yy0, yy1));
+        _mm256_storeu_si256((__m256i *)(out[4] + x), vif_pack64_avx2(xy0, xy1));
+    }
+
+    if (x < width) {
+        const uint16_t *ref_tail[VIF_MAX_TAPS], *dis_tail[VIF_MAX_TAPS];
+        uint32_t *tail[5] = {out[0] + x, out[1] + x, out[2] + x, out[3] + x, out[4] + x};
+        for (int k = 0; k < taps; k++) {
+            ref_tail[k] = ref[k] + x;
+            dis_tail[k] = dis[k] + x;
+        }
+        vif_vfilter_c(ref_tail, dis_tail, f, taps, width - x, tail);
+    }
+}
+
+__attribute__((target("avx2")))
+static void vif_hfilter_avx2(const uint32_t *const in[5], const uint16_t *f, int taps, int width,
+                             uint32_t *const out[5]) {
+    int x = 0;
+
+    for (; x + 8 <= width; x += 8) {
+        __m256i mu1 = _mm256_setzero_si256(), mu2 = _mm256_setzero_si256();
+        __m256i sq0[3], sq1[3];
+        for (int i = 0; i < 3; i++)
+            sq0[i] = sq1[i] = _mm256_setzero_si256();
+        for (int k = 0; k < taps; k++) {
+            __m256i fk = _mm256_set1_epi32(f[k]);
+            mu1 = _mm256_add_epi32(mu1, _mm256_mullo_epi32(fk, _mm256_loadu_si256((const __m256i *)(in[0] + x + k))));
+            mu2 = _mm256_add_epi32(mu2, _mm256_mullo_epi32(fk, _mm256_loadu_si256((const __m256i *)(in[1] + x + k))));
+            for (int i = 0; i < 3; i++) {
+                __m256i v = _mm256_loadu_si256((const __m256i *)(in[2 + i] + x + k));
+                sq0[i] = _mm256_add_epi64(sq0[i], _mm256_mul_epu32(fk, v));
+                sq1[i] = _mm256_add_epi64(sq1[i], _mm256_mul_epu32(fk, _mm256_srli_epi64(v, 32)));
+            }
+        }
+        _mm256_storeu_si256((__m256i *)(out[0] + x), mu1);
+        _mm256_storeu_si256((__m256i *)(out[1] + x), mu2);
+        for (int i = 0; i < 3; i++)
+            _mm256_storeu_si256((__m256i *)(out[2 + i] + x), vif_pack64_avx2(sq0[i], sq1[i]));
+    }
+
+    if (x < width) {
+        const uint32_t *in_tail[5] = {in[0] + x, in[1] + x, in[2] + x, in[3] + x, in[4] + x};
+        uint32_t *tail[5] = {out[0] + x, out[1] + x, out[2] + x, out[3] + x, out[4] + x};
+        vif_hfilter_c(in_tail, f, taps, width - x, tail);
+    }
+}
+
+/*
+ * vif_best16() on 4 doubles holding positive integers below 2^53: the
+ * exponent comes from the bits, and scaling by a power of 2 is exact.
+ */
+__attribute__((target("avx2")))
+static inline __m128i vif_log2_avx2(__m256d v, const uint16_t *log2_table, __m256i *x) {
+    __m256i e = _mm256_sub_epi64(_mm256_srli_epi64(_mm256_castpd_si256(v), 52), _mm256_set1_epi64x(1023));
+    __m256d scale = _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_sub_epi64(_mm256_set1_epi64x(15 + 1023), e), 52));
+    __m128i mant = _mm256_cvttpd_epi32(_mm256_floor_pd(_mm256_mul_pd(v, scale)));
+    __m128i idx = _mm_sub_epi32(mant, _mm_set1_epi32(32768));
+    *x = _mm256_sub_epi64(_mm256_set1_epi64x(15), e);
+    return _mm_and_si128(_mm_i32gather_epi32((const int *)log2_table, idx, 2), _mm_set1_epi32(0xffff));
+}
+
+// the low 32 bits of each 64-bit lane
+__attribute__((target("avx2")))
+static inline __m128i vif_lo32_avx2(__m256i v) {
+    return _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6)));
+}
+
+/*
+ * 4 pixels at a time: the moments in 64-bit lanes, then the sigmas as int32
+ * and the rest in doubles, with both branches of vif_stat_pixel() computed
+ * and masked. Lanes outside a branch get sigma_nsq as the log argument so
+ * the table lookups stay in range.
+ */
+__attribute__((target("avx2")))
+static void vif_stat_avx2(const uint32_t *const in[5], int width, double gain_limit, VifAccum *acc) {
+    const uint16_t *log2_table = vif_log2_table();
+    const __m256i round = _mm256_set1_epi64x(0x80000000);
+    const __m128i nsq = _mm_set1_epi32(VIF_SIGMA_NSQ);
+    const __m128i zero = _mm_setzero_si128();
+    const __m256d nsqd = _mm256_set1_pd(VIF_SIGMA_NSQ);
+    __m256i num_log = _mm256_setzero_si256(), num_x = _mm256_setzero_si256();
+    __m256i den_log = _mm256_setzero_si256(), den_x = _mm256_setzero_si256(), nb_log = _mm256_setzero_si256();
+    __m256i num_non_log = _mm256_setzero_si256(), nb_non_log = _mm256_setzero_si256();
+    int x = 0;
+
+    for (; x + 4 <= width; x += 4) {
+        __m256i m[5];
+        for (int i = 0; i < 5; i++)
+            m[i] = _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i *)(in[i] + x)));
+        __m256i mu1_sq = _mm256_srli_epi64(_mm256_add_epi64(_mm256_mul_epu32(m[0], m[0]), round), 32);
+        __m256i mu2_sq = _mm256_srli_epi64(_mm256_add_epi64(_mm256_mul_epu32(m[1], m[1]), round), 32);
+        __m256i mu1_mu2 = _mm256_srli_epi64(_mm256_add_epi64(_mm256_mul_epu32(m[0], m[1]), round), 32);
+        __m128i sigma1_sq = vif_lo32_avx2(_mm256_sub_epi64(m[2], mu1_sq));
+        __m128i sigma2_sq = _mm_max_epi32(vif_lo32_avx2(_mm256_sub_epi64(m[3], mu2_sq)), zero);
+        __m128i sigma12 = vif_lo32_avx2(_mm256_sub_epi64(m[4], mu1_mu2));
+
+        __m128i is_log = _mm_cmpgt_epi32(sigma1_sq, _mm_sub_epi32(nsq, _mm_set1_epi32(1)));
+        __m128i is_num = _mm_and_si128(is_log, _mm_and_si128(_mm_cmpgt_epi32(sigma12, zero),
+                                                             _mm_cmpgt_epi32(sigma2_sq, zero)));
+        __m256i log_mask = _mm256_cvtepi32_epi64(is_log);
+        __m256i num_mask = _mm256_cvtepi32_epi64(is_num);
+
+        num_non_log = _mm256_add_epi64(num_non_log, _mm256_andnot_si256(log_mask, _mm256_cvtepi32_epi64(sigma2_sq)));
+        nb_non_log = _mm256_sub_epi64(nb_non_log, _mm256_xor_si256(log_mask, _mm256_set1_epi64x(-1)));
+
+        __m256d s1 = _mm256_cvtepi32_pd(sigma1_sq);
+        __m256d s2 = _mm256_cvtepi32_pd(sigma2_sq);
+        __m256d s12 = _mm256_cvtepi32_pd(sigma12);
+        __m256i xd, xn, xt;
+
+        __m256d den = _mm256_blendv_pd(nsqd, _mm256_add_pd(nsqd, s1), _mm256_castsi256_pd(log_mask));
+        __m128i den_l = vif_log2_avx2(den, log2_table, &xd);
+        den_log = _mm256_add_epi64(den_log, _mm256_and_si256(log_mask, _mm256_cvtepi32_epi64(den_l)));
+        den_x = _mm256_add_epi64(den_x, _mm256_and_si256(log_mask, xd));
+        nb_log = _mm256_sub_epi64(nb_log, log_mask);
+
+        __m256d g = _mm256_div_pd(s12, _mm256_add_pd(s1, _mm256_set1_pd(VIF_EPS)));
+        __m128i sv_sq = _mm_max_epi32(_mm256_cvttpd_epi32(_mm256_sub_pd(s2, _mm256_mul_pd(g, s12))), zero);
+        g = _mm256_min_pd(g, _mm256_set1_pd(gain_limit));
+        __m256d numer1 = _mm256_cvtepi32_pd(_mm_add_epi32(sv_sq, nsq));
+        __m256d numer1_tmp = _mm256_add_pd(_mm256_round_pd(_mm256_mul_pd(_mm256_mul_pd(g, g), s1),
+                                                           _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC), numer1);
+        numer1 = _mm256_blendv_pd(nsqd, numer1, _mm256_castsi256_pd(num_mask));
+        numer1_tmp = _mm256_blendv_pd(nsqd, numer1_tmp, _mm256_castsi256_pd(num_mask));
+        __m128i n = vif_log2_avx2(numer1_tmp, log2_table, &xt);
+        __m128i d = vif_log2_avx2(numer1, log2_table, &xn);
+        num_log = _mm256_add_epi64(num_log, _mm256_and_si256(num_mask, _mm256_cvtepi32_epi64(_mm_sub_epi32(n, d))));
+        num_x = _mm256_add_epi64(num_x, _mm256_and_si256(num_mask, _mm256_sub_epi64(xn, xt)));
+    }
+
+    int64_t sums[7][4];
+    _mm256_storeu_si256((__m256i *)sums[0], num_log);
+    _mm256_storeu_si256((__m256i *)sums[1], num_x);
+    _mm256_storeu_si256((__m256i *)sums[2], den_log);
+    _mm256_storeu_si256((__m256i *)sums[3], den_x);
+    _mm256_storeu_si256((__m256i *)sums[4], nb_log);
+    _mm256_storeu_si256((__m256i *)sums[5], num_non_log);
+    _mm256_storeu_si256((__m256i *)sums[6], nb_non_log);
+    for (int i = 0; i < 4; i++) {
+        acc->num_log += sums[0][i];
+        acc->num_x += sums[1][i];
+        acc->den_log += sums[2][i];
+        acc->den_x += sums[3][i];
+        acc->nb_log += sums[4][i];
+        acc->num_non_log += sums[5][i];
+        acc->nb_non_log += sums[6][i];
+    }
+
+    for (; x < width; x++)
+        vif_stat_pixel(in[0][x], in[1][x], in[2][x], in[3][x], in[4][x], gain_limit, log2_table, acc);
+}
+#endif
+
+typedef struct {
+    void (*vfilter)(const uint16_t *const ref[], const uint16_t *const dis[], const uint16_t *f, int taps,
+                    int width, uint32_t *const out[5]);
+    void (*hfilter)(const uint32_t *const in[5], const uint16_t *f, int taps, int width, uint32_t *const out[5]);
+    void (*stat)(const uint32_t *const in[5], int width, double gain_limit, VifAccum *acc);
+} VifDSPContext;
+
+static const VifDSPContext &vif_dsp() {
+    static VifDSPContext dsp;
+    static std::once_flag once;
+    std::call_once(once, [] {
+        dsp.vfilter = vif_vfilter_c;
+        dsp.hfilter = vif_hfilter_c;
+        dsp.stat = vif_stat_c;
+#if VIF_ARCH_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            dsp.vfilter = vif_vfilter_avx2;
+            dsp.hfilter = vif_hfilter_avx2;
+            dsp.stat = vif_stat_avx2;
+        }
+#endif
+    });
+    return dsp;
+}
+
+static inline int vif_mirror(int i, int n) {
+    return i < 0 ? -i : i >= n ? 2 * n - 2 - i : i;
+}
+
+/*
+ * All buffers for planes up to width x height, allocated by vif_init(), so
+ * scoring doesn't allocate. One context per thread.
+ */
+typedef struct {
+    int width;
+    int height;
+    double gain_limit;
+    uint16_t *ref[VIF_SCALES];  // the planes at each scale, 8.8 fixed point
+    uint16_t *dis[VIF_SCALES];
+    uint32_t *vbuf[5];          // one row of vertical moments, VIF_PAD columns of mirror padding each side
+    uint32_t *hbuf[5];          // one row of filtered moments
+    uint32_t *tmp[2];           // one row of vertically filtered ref/dis when decimating, padded like vbuf
+} VIFContext;
+
+static void vif_uninit(VIFContext *ctx) {
+    for (int s = 0; s < VIF_SCALES; s++) {
+        free(ctx->ref[s]);
+        free(ctx->dis[s]);
+    }
+    for (int i = 0; i < 5; i++) {
+        free(ctx->vbuf[i]);
+        free(ctx->hbuf[i]);
+    }
+    free(ctx->tmp[0]);
+    free(ctx->tmp[1]);
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+static int vif_init(VIFContext *ctx, int width, int height, double gain_limit = VIF_GAIN_LIMIT) {
+    int ok = 1;
+
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->width = width;
+    ctx->height = height;
+    ctx->gain_limit = gain_limit;
+    for (int s = 0; s < VIF_SCALES; s++) {
+        size_t size = (size_t)(width >> s) * (height >> s) + 1;
+        ok &= !!(ctx->ref[s] = (uint16_t *)malloc(size * sizeof(uint16_t)));
+        ok &= !!(ctx->dis[s] = (uint16_t *)malloc(size * sizeof(uint16_t)));
+    }
+    for (int i = 0; i < 5; i++) {
+        ok &= !!(ctx->vbuf[i] = (uint32_t *)malloc((width + 2 * VIF_PAD) * sizeof(uint32_t)));
+        ok &= !!(ctx->hbuf[i] = (uint32_t *)malloc(width * sizeof(uint32_t)));
+    }
+    for (int i = 0; i < 2; i++)
+        ok &= !!(ctx->tmp[i] = (uint32_t *)malloc((width + 2 * VIF_PAD) * sizeof(uint32_t)));
+    if (!ok) {
+        vif_uninit(ctx);
+        return -1;
+    }
+    return 0;
+}
+
+static void vif_pad_row(uint32_t *row, int width, int half) {
+    for (int k = 1; k <= half; k++) {
+        row[-k] = row[k];
+        row[width - 1 + k] = row[width - 1 - k];
+    }
+}
+
+// filter src with the scale's Gaussian and keep the even rows and columns
+static void vif_decimate(const uint16_t *src, int width, int height, int scale, uint32_t *tmp, uint16_t *dst) {
+    const uint16_t *f = vif_filter[scale];
+    int taps = vif_filter_taps[scale];
+    int half = taps / 2;
+
+    for (int y = 0; y < height / 2; y++) {
+        const uint16_t *rows[VIF_MAX_TAPS];
+        for (int k = 0; k < taps; k++)
+            rows[k] = src + (size_t)vif_mirror(2 * y - half + k, height) * width;
+        for (int x = 0; x < width; x++) {
+            uint32_t sum = 0;
+            for (int k = 0; k < taps; k++)
+                sum += f[k] * (uint32_t)rows[k][x];
+            tmp[x] = (sum + 32768) >> 16;
+        }
+        vif_pad_row(tmp, width, half);
+        for (int x = 0; x < width / 2; x++) {
+            uint32_t sum = 0;
+            for (int k = 0; k < taps; k++)
+                sum += f[k] * tmp[2 * x - half + k];
+            dst[(size_t)y * (width / 2) + x] = (sum + 32768) >> 16;
+        }
+    }
+}
+
+static void vif_scale_stats(VIFContext *ctx, int scale, int width, int height, VifAccum *acc) {
+    const VifDSPContext &dsp = vif_dsp();
+    const uint16_t *f = vif_filter[scale];
+    int taps = vif_filter_taps[scale];
+    int half = taps / 2;
+    uint32_t *vrow[5];
+    const uint32_t *hin[5];
+
+    for (int i = 0; i < 5; i++) {
+        vrow[i] = ctx->vbuf[i] + VIF_PAD;
+        hin[i] = vrow[i] - half;
+    }
+    for (int y = 0; y < height; y++) {
+        const uint16_t *ref[VIF_MAX_TAPS], *dis[VIF_MAX_TAPS];
+        for (int k = 0; k < taps; k++) {
+            size_t row = (size_t)vif_mirror(y - half + k, height) * width;
+            ref[k] = ctx->ref[scale] + row;
+            dis[k] = ctx->dis[scale] + row;
+        }
+        dsp.vfilter(ref, dis, f, taps, width, vrow);
+        for (int i = 0; i < 5; i++)
+            vif_pad_row(vrow[i], width, half);
+        dsp.hfilter(hin, f, taps, width, ctx->hbuf);
+        dsp.stat(ctx->hbuf, width, ctx->gain_limit, acc);
+    }
+}
+
+/*
+ * VIF of one plane at the given bit depth (uint8_t samples for 8 bits,
+ * uint16_t above), strides in samples. Returns -1 if the plane is larger
+ * than the context, or too small for the filters at the smallest scale.
+ */
+template <typename T>
+static int vif_plane(VIFContext *ctx, const T *ref, intptr_t ref_stride, const T *dis, intptr_t dis_stride,
+                     int width, int height, int depth, VifScore *score) {
+    double num_sum = 0, den_sum = 0;
+    int shift = 16 - depth;
+
+    if (width > ctx->width || height > ctx->height)
+        return -1;
+    for (int s = 0; s < VIF_SCALES; s++) {
+        if ((width >> s) <= vif_filter_taps[s] / 2 || (height >> s) <= vif_filter_taps[s] / 2)
+            return -1;
+    }
+
+    for (int y = 0; y < height; y++) {
+        uint16_t *r = ctx->ref[0] + (size_t)y * width, *d = ctx->dis[0] + (size_t)y * width;
+        for (int x = 0; x < width; x++) {
+            r[x] = ref[y * ref_stride + x] << shift;
+            d[x] = dis[y * dis_stride + x] << shift;
+        }
+    }
+
+    for (int s = 0; s < VIF_SCALES; s++) {
+        int w = width >> s, h = height >> s;
+        VifAccum acc;
+
+        if (s) {
+            vif_decimate(ctx->ref[s - 1], width >> (s - 1), height >> (s - 1), s, ctx->tmp[0] + VIF_PAD, ctx->ref[s]);
+            vif_decimate(ctx->dis[s - 1], width >> (s - 1), height >> (s - 1), s, ctx->tmp[1] + VIF_PAD, ctx->dis[s]);
+        }
+        memset(&acc, 0, sizeof(acc));
+        vif_scale_stats(ctx, s, w, h, &acc);
+
+        double num = acc.num_log / 2048.0 + acc.num_x + (acc.nb_non_log - acc.num_non_log / 16384.0 / 65025.0);
+        double den = acc.den_log / 2048.0 - acc.den_x - 17.0 * acc.nb_log + acc.nb_non_log;
+        score->scale[s] = num / den;
+        num_sum += num;
+        den_sum += den;
+    }
+    score->vif = num_sum / den_sum;
+    return 0;
+}
+
+#endif /* VIF_CORE_H */